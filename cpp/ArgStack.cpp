@@ -0,0 +1,25 @@
+#include "ArgStack.h"
+#include "Types.h"
+
+// Enough for any depth of recursion an 8MB C++ stack can take. Memory is
+// only touched as the stack grows into it.
+static const size_t s_capacity = 1 << 20;
+
+static malValueVec reserved()
+{
+    malValueVec stack;
+    stack.reserve(s_capacity);
+    return stack;
+}
+
+malValueVec ArgStack::s_stack = reserved();
+
+void ArgStack::reserve(size_t capacity)
+{
+    s_stack.reserve(capacity);
+}
+
+void ArgStack::overflow()
+{
+    MAL_FAIL("Argument stack overflow");
+}
@@ -0,0 +1,66 @@
+#ifndef INCLUDE_ARGSTACK_H
+#define INCLUDE_ARGSTACK_H
+
+#include "MAL.h"
+
+#include <utility>
+
+// Arguments are evaluated onto one stack, rather than into a new vector for
+// each call. Its storage is reserved up front and never moves, so the range
+// a builtin or malEnv is handed stays valid while it calls back into EVAL.
+class ArgStack {
+public:
+    // The values pushed since it was made, which are popped when it goes.
+    class Frame {
+    public:
+        Frame() : m_base(s_stack.size()) { }
+        ~Frame() {
+            while (s_stack.size() > m_base) {
+                s_stack.pop_back();
+            }
+        }
+
+        void push(const malValuePtr& value) {
+            if (s_stack.size() == s_stack.capacity()) {
+                overflow();
+            }
+            s_stack.push_back(value);
+        }
+
+        void push(malValuePtr&& value) {
+            if (s_stack.size() == s_stack.capacity()) {
+                overflow();
+            }
+            s_stack.push_back(std::move(value));
+        }
+
+        int count() const { return s_stack.size() - m_base; }
+
+        malValueIter begin() const { return s_stack.begin() + m_base; }
+        malValueIter end() const { return s_stack.end(); }
+
+        malValuePtr& operator [] (int i) const { return s_stack[m_base + i]; }
+
+    private:
+        Frame(const Frame&); // no copy ctor
+        Frame& operator = (const Frame&); // no assignments
+
+        const size_t m_base;
+    };
+
+    // Sets how many values the stack can hold. This must be done before
+    // anything is pushed.
+    static void reserve(size_t capacity);
+
+    // The iterator for a value within the stack.
+    static malValueIter iterator(const malValuePtr* value) {
+        return s_stack.begin() + (value - s_stack.data());
+    }
+
+private:
+    static void overflow();
+
+    static malValueVec s_stack;
+};
+
+#endif // INCLUDE_ARGSTACK_H
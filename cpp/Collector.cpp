@@ -0,0 +1,197 @@
+#include "Collector.h"
+#include "Types.h"
+
+#include <climits>
+#include <cstdint>
+#include <unordered_map>
+
+uint64_t Collector::s_interval = 1 << 20;
+uint64_t Collector::s_nextCollection = 1 << 20;
+Collector::Stats Collector::s_stats;
+
+bool   RefCounted::s_destroyLater = false;
+size_t RefCounted::s_destroySlice = SIZE_MAX;
+static bool s_isDestroying = false;
+
+// Objects are still freed as the program exits, after static objects have
+// been destroyed, so the possible roots are never freed themselves.
+static std::vector<const RefCounted*>& possibleRoots()
+{
+    static std::vector<const RefCounted*>* roots =
+        new std::vector<const RefCounted*>;
+    return *roots;
+}
+
+void RefCounted::bufferRoot() const
+{
+    std::vector<const RefCounted*>& roots = possibleRoots();
+    m_rootIndex = roots.size();
+    roots.push_back(this);
+}
+
+void RefCounted::forgetRoot() const
+{
+    // The last root takes this one's place.
+    std::vector<const RefCounted*>& roots = possibleRoots();
+    const RefCounted* last = roots.back();
+    roots[m_rootIndex] = last;
+    last->m_rootIndex = m_rootIndex;
+    roots.pop_back();
+    m_rootIndex = NotBuffered;
+}
+
+// The objects whose last reference has gone, waiting to be freed. As with
+// the possible roots, this outlives the static objects.
+static std::vector<const RefCounted*>& dyingObjects()
+{
+    static std::vector<const RefCounted*>* objects =
+        new std::vector<const RefCounted*>;
+    return *objects;
+}
+
+void RefCounted::destroy() const
+{
+    // Nothing refers to it now, so it can't be part of a cycle.
+    if (m_rootIndex >= 0) {
+        forgetRoot();
+    }
+    m_rootIndex = NotACandidate;
+
+    // If this is being released by another object's destructor, the loop
+    // which is freeing that one will get to it.
+    dyingObjects().push_back(this);
+    if (!s_isDestroying) {
+        destroyPending(s_destroySlice);
+    }
+}
+
+void RefCounted::destroyPending(size_t limit)
+{
+    if (s_isDestroying) {
+        return;
+    }
+    s_isDestroying = true;
+    std::vector<const RefCounted*>& objects = dyingObjects();
+    for (size_t i = 0; (i < limit) && !objects.empty(); i++) {
+        const RefCounted* object = objects.back();
+        objects.pop_back();
+        delete object;
+    }
+    s_destroyLater = !objects.empty();
+    s_isDestroying = false;
+}
+
+void RefCounted::setDestroySlice(size_t objects)
+{
+    s_destroySlice = objects > 0 ? objects : SIZE_MAX;
+}
+
+void RefVisitor::operator () (malValuePtr& ref)
+{
+    if (m_isClearing) {
+        ref = malValuePtr();
+    }
+    else if (ref.isManaged()) {
+        m_found.push_back(ref.ptr());
+    }
+}
+
+uint64_t Collector::collect()
+{
+    s_nextCollection = Pool::stats().allocations + s_interval;
+    s_stats.collections++;
+
+    // Each object reachable from the roots, with the references the others
+    // hold to it taken off its count.
+    const int Live = INT_MAX;
+    std::unordered_map<RefCounted*, int> counts;
+    std::vector<RefCounted*> pending;
+
+    std::vector<const RefCounted*>& roots = possibleRoots();
+    for (auto it = roots.begin(), end = roots.end(); it != end; ++it) {
+        RefCounted* root = const_cast<RefCounted*>(*it);
+        root->m_rootIndex = RefCounted::NotBuffered;
+        counts.emplace(root, root->m_refCount);
+        pending.push_back(root);
+    }
+    roots.clear();
+
+    RefVisitor tracer(false);
+    while (!pending.empty()) {
+        RefCounted* object = pending.back();
+        pending.pop_back();
+        object->visitRefs(tracer);
+        for (auto it = tracer.m_found.begin(), end = tracer.m_found.end();
+             it != end; ++it) {
+            auto entry = counts.emplace(*it, (*it)->m_refCount);
+            if (entry.second) {
+                pending.push_back(*it);
+            }
+            entry.first->second--;
+        }
+        tracer.m_found.clear();
+    }
+
+    // Anything still referred to from elsewhere is live, and so is
+    // everything it refers to.
+    for (auto it = counts.begin(), end = counts.end(); it != end; ++it) {
+        if (it->second != 0) {
+            it->second = Live;
+            pending.push_back(it->first);
+        }
+    }
+    while (!pending.empty()) {
+        RefCounted* object = pending.back();
+        pending.pop_back();
+        object->visitRefs(tracer);
+        for (auto it = tracer.m_found.begin(), end = tracer.m_found.end();
+             it != end; ++it) {
+            auto entry = counts.find(*it);
+            if (entry->second != Live) {
+                entry->second = Live;
+                pending.push_back(*it);
+            }
+        }
+        tracer.m_found.clear();
+    }
+
+    // What's left is garbage. Holding on to it while its references are
+    // cleared means that letting go frees it all, along with anything only
+    // it referred to.
+    std::vector<RefCountedPtr<RefCounted>> garbage;
+    for (auto it = counts.begin(), end = counts.end(); it != end; ++it) {
+        if (it->second == 0) {
+            garbage.push_back(it->first);
+        }
+    }
+    counts.clear();
+    if (garbage.empty()) {
+        return 0;
+    }
+
+    // Anything already waiting to be freed isn't part of this.
+    RefCounted::destroyPending(SIZE_MAX);
+    const Pool::Stats& pool = Pool::stats();
+    uint64_t frees = pool.frees;
+    uint64_t freedBytes = pool.freedBytes;
+
+    RefVisitor clearer(true);
+    for (auto it = garbage.begin(), end = garbage.end(); it != end; ++it) {
+        (*it)->visitRefs(clearer);
+    }
+    garbage.clear();
+    // Finish freeing it now, even if freeing is usually done in slices, so
+    // that all of it is counted.
+    RefCounted::destroyPending(SIZE_MAX);
+
+    uint64_t bytes = pool.freedBytes - freedBytes;
+    s_stats.objects += pool.frees - frees;
+    s_stats.bytes += bytes;
+    return bytes;
+}
+
+void Collector::setInterval(uint64_t allocations)
+{
+    s_interval = allocations;
+    s_nextCollection = Pool::stats().allocations + allocations;
+}
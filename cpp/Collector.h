@@ -0,0 +1,75 @@
+#ifndef INCLUDE_COLLECTOR_H
+#define INCLUDE_COLLECTOR_H
+
+#include "RefCountedPtr.h"
+#include "ValuePtr.h"
+
+#include <cstdint>
+#include <vector>
+
+// Is handed each reference an object holds, by RefCounted::visitRefs. It
+// either follows the references, or clears them to break a cycle.
+class RefVisitor {
+public:
+    void operator () (malValuePtr& ref);
+
+    template<class T>
+    void operator () (RefCountedPtr<T>& ref) {
+        if (m_isClearing) {
+            ref = RefCountedPtr<T>();
+        }
+        else if (ref) {
+            m_found.push_back(ref.ptr());
+        }
+    }
+
+private:
+    friend class Collector;
+
+    RefVisitor(bool isClearing) : m_isClearing(isClearing) { }
+
+    const bool               m_isClearing;
+    std::vector<RefCounted*> m_found;
+};
+
+// Frees the cycles which refcounting alone never can, such as a recursive
+// function defined in a let*, whose environment refers back to it.
+//
+// This is synchronous trial deletion, after Bacon and Rajan. An object which
+// has a reference released, but not its last one, may be all that keeps a
+// garbage cycle alive, so it is remembered as a possible root. A collection
+// then subtracts the references which the objects reachable from the roots
+// hold to each other. Anything left with a count of zero is only referred to
+// from within that garbage, and can't be reached from the program.
+class Collector {
+public:
+    struct Stats {
+        uint64_t collections;
+        uint64_t objects; // freed by collections
+        uint64_t bytes;   // ... and the memory they took
+    };
+
+    // Collects if enough has been allocated since the last collection.
+    // Evaluation calls this at points where nothing is held without a
+    // reference.
+    static void safePoint() {
+        if (Pool::stats().allocations >= s_nextCollection) {
+            collect();
+        }
+    }
+
+    // Returns how many bytes were freed.
+    static uint64_t collect();
+
+    // How many allocations there are between collections.
+    static void setInterval(uint64_t allocations);
+
+    static const Stats& stats() { return s_stats; }
+
+private:
+    static uint64_t s_interval;
+    static uint64_t s_nextCollection;
+    static Stats    s_stats;
+};
+
+#endif // INCLUDE_COLLECTOR_H
@@ -0,0 +1,623 @@
+#include "ArgStack.h"
+#include "Compiler.h"
+#include "Environment.h"
+
+#include <algorithm>
+#include <exception>
+#include <utility>
+
+// The compiler turns each form into a tree of malCode nodes. Symbols are
+// resolved as the form is compiled, so at run time a local is found by its
+// frame depth and slot, and a global by a pointer to its cell. Anything the
+// compiler can't do just as the interpreter would, it leaves to the
+// interpreter by compiling an Interpret node.
+
+namespace {
+
+// Evaluates code which isn't in tail position, and so never makes a tail
+// call.
+inline malValuePtr value(const malCodePtr& code, const malEnvPtr& env)
+{
+    malTailCall tail;
+    return code->exec(env, tail);
+}
+
+typedef std::vector<malCodePtr> malCodeVec;
+
+class Constant : public malCode {
+public:
+    Constant(malValuePtr value) : m_value(value) { }
+
+    virtual malValuePtr exec(const malEnvPtr& env, malTailCall& tail) const {
+        return m_value;
+    }
+
+private:
+    const malValuePtr m_value;
+};
+
+class LocalRef : public malCode {
+public:
+    LocalRef(int depth, int slot, const malSymbol* symbol)
+    : m_depth(depth), m_slot(slot), m_symbol(symbol) { }
+
+    virtual malValuePtr exec(const malEnvPtr& env, malTailCall& tail) const {
+        if (malValuePtr* value = env->local(m_depth, m_slot, m_symbol)) {
+            return *value;
+        }
+        // Not bound yet, as in (let* (a a) ...), so search for it as the
+        // interpreter would.
+        return env->get(m_symbol);
+    }
+
+private:
+    const int m_depth;
+    const int m_slot;
+    const malSymbol* m_symbol;
+};
+
+class GlobalRef : public malCode {
+public:
+    GlobalRef(const malSymbol* symbol) : m_symbol(symbol), m_cell(NULL) { }
+
+    virtual malValuePtr exec(const malEnvPtr& env, malTailCall& tail) const {
+        if (!m_cell) {
+            // Global cells never move, so once found it's kept.
+            m_cell = env->globalCell(m_symbol);
+            MAL_CHECK(m_cell, "'%s' not found", m_symbol->value().c_str());
+        }
+        return *m_cell;
+    }
+
+private:
+    const malSymbol* m_symbol;
+    mutable malValuePtr* m_cell;
+};
+
+class Interpret : public malCode {
+public:
+    Interpret(malValuePtr form) : m_form(form) { }
+
+    virtual malValuePtr exec(const malEnvPtr& env, malTailCall& tail) const {
+        return interpret(m_form, env);
+    }
+
+private:
+    const malValuePtr m_form;
+};
+
+class If : public malCode {
+public:
+    If(malCodePtr test, malCodePtr then, malCodePtr otherwise)
+    : m_test(test), m_then(then), m_otherwise(otherwise) { }
+
+    virtual malValuePtr exec(const malEnvPtr& env, malTailCall& tail) const {
+        if (value(m_test, env)->isTrue()) {
+            return m_then->exec(env, tail);
+        }
+        if (!m_otherwise) {
+            return mal::nilValue();
+        }
+        return m_otherwise->exec(env, tail);
+    }
+
+private:
+    const malCodePtr m_test;
+    const malCodePtr m_then;
+    const malCodePtr m_otherwise;
+};
+
+class Do : public malCode {
+public:
+    Do(const malCodeVec& body) : m_body(body) { }
+
+    virtual malValuePtr exec(const malEnvPtr& env, malTailCall& tail) const {
+        int last = m_body.size() - 1;
+        for (int i = 0; i < last; i++) {
+            value(m_body[i], env);
+        }
+        return m_body[last]->exec(env, tail);
+    }
+
+private:
+    const malCodeVec m_body;
+};
+
+class Let : public malCode {
+public:
+    Let(const malSymbolVec& names, const malCodeVec& values, malCodePtr body)
+    : m_names(names), m_values(values), m_body(body) { }
+
+    virtual malValuePtr exec(const malEnvPtr& env, malTailCall& tail) const {
+        malEnvPtr inner(new malEnv(env));
+        for (int i = 0, count = m_names.size(); i < count; i++) {
+            inner->bind(m_names[i], value(m_values[i], inner));
+        }
+        return m_body->exec(inner, tail);
+    }
+
+private:
+    const malSymbolVec m_names;
+    const malCodeVec   m_values;
+    const malCodePtr   m_body;
+};
+
+class Fn : public malCode {
+public:
+    Fn(const malSymbolVec& params, malValuePtr body, malCodePtr code)
+    : m_params(params), m_body(body), m_code(code) { }
+
+    virtual malValuePtr exec(const malEnvPtr& env, malTailCall& tail) const {
+        return mal::lambda(m_params, m_body, env, m_code);
+    }
+
+private:
+    const malSymbolVec m_params;
+    const malValuePtr  m_body;
+    const malCodePtr   m_code;
+};
+
+class Def : public malCode {
+public:
+    Def(const malSymbol* symbol, malCodePtr value, bool isMacro)
+    : m_symbol(symbol), m_value(value), m_isMacro(isMacro) { }
+
+    virtual malValuePtr exec(const malEnvPtr& env, malTailCall& tail) const {
+        malValuePtr body = value(m_value, env);
+        if (m_isMacro) {
+            const malLambda* lambda = VALUE_CAST(malLambda, body);
+            body = mal::macro(*lambda);
+        }
+        return env->set(m_symbol, body);
+    }
+
+private:
+    const malSymbol*  m_symbol;
+    const malCodePtr  m_value;
+    const bool        m_isMacro;
+};
+
+class Try : public malCode {
+public:
+    Try(malCodePtr body, const malSymbol* symbol, malCodePtr handler)
+    : m_body(body), m_symbol(symbol), m_handler(handler) { }
+
+    virtual malValuePtr exec(const malEnvPtr& env, malTailCall& tail) const {
+        malValuePtr excVal;
+
+        try {
+            return value(m_body, env);
+        }
+        catch(String& s) {
+            excVal = mal::string(s);
+        }
+        catch (malEmptyInputException&) {
+            // Not an error, continue as if we got nil
+            return mal::nilValue();
+        }
+        catch(malValuePtr& o) {
+            excVal = o;
+        };
+
+        malEnvPtr inner(new malEnv(env));
+        inner->bind(m_symbol, excVal);
+        return m_handler->exec(inner, tail);
+    }
+
+private:
+    const malCodePtr m_body;
+    const malSymbol* m_symbol;
+    const malCodePtr m_handler;
+};
+
+class Vector : public malCode {
+public:
+    Vector(const malCodeVec& items) : m_items(items) { }
+
+    virtual malValuePtr exec(const malEnvPtr& env, malTailCall& tail) const {
+        malValueVec* items = new malValueVec;
+        items->reserve(m_items.size());
+        for (auto it = m_items.begin(), end = m_items.end(); it != end; ++it) {
+            items->push_back(value(*it, env));
+        }
+        return mal::vector(items);
+    }
+
+private:
+    const malCodeVec m_items;
+};
+
+class Hash : public malCode {
+public:
+    Hash(const malValueVec& keys, const malCodeVec& values)
+    : m_keys(keys), m_values(values) { }
+
+    virtual malValuePtr exec(const malEnvPtr& env, malTailCall& tail) const {
+        malValueVec items;
+        items.reserve(2 * m_keys.size());
+        for (int i = 0, count = m_keys.size(); i < count; i++) {
+            items.push_back(m_keys[i]);
+            items.push_back(value(m_values[i], env));
+        }
+        return mal::hash(items.begin(), items.end(), true);
+    }
+
+private:
+    const malValueVec m_keys;
+    const malCodeVec  m_values;
+};
+
+class Call : public malCode {
+public:
+    Call(malValuePtr form, malCodePtr op, const malCodeVec& args,
+         bool isTail)
+    : m_form(form), m_op(op), m_args(args), m_isTail(isTail) { }
+
+    virtual malValuePtr exec(const malEnvPtr& env, malTailCall& tail) const {
+        malValuePtr op = value(m_op, env);
+        const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+        if (lambda && lambda->isMacro()) {
+            // It wasn't a macro when this was compiled.
+            return interpret(m_form, env);
+        }
+
+        ArgStack::Frame args;
+        for (auto it = m_args.begin(), end = m_args.end(); it != end; ++it) {
+            args.push(value(*it, env));
+        }
+
+        if (lambda && lambda->getCode()) {
+            malEnvPtr inner = lambda->makeEnv(args.begin(), args.end());
+            if (m_isTail) {
+                tail.code = lambda->getCode();
+                tail.env = std::move(inner);
+                return malValuePtr();
+            }
+            return lambda->getCode()->run(std::move(inner));
+        }
+        return APPLY(op, args.begin(), args.end());
+    }
+
+private:
+    const malValuePtr m_form;
+    const malCodePtr  m_op;
+    const malCodeVec  m_args;
+    const bool        m_isTail;
+};
+
+// A macro call is expanded when it's compiled, so this just makes sure the
+// macro hasn't been redefined since. If the expansion raised an error, the
+// same error is raised here instead.
+//
+// A macro may redefine itself as it expands. Its expansion still stands the
+// first time the call is reached, as it would for the interpreter, but the
+// call is expanded again by the new macro after that.
+class MacroCall : public malCode {
+public:
+    MacroCall(malValuePtr form, malValuePtr* cell, malValuePtr macro,
+              malCodePtr expansion, std::exception_ptr error = nullptr)
+    : m_form(form), m_cell(cell), m_macro(macro), m_redefinedAs(*cell)
+    , m_expansion(expansion), m_error(error) { }
+
+    virtual malValuePtr exec(const malEnvPtr& env, malTailCall& tail) const {
+        malValuePtr redefinedAs = std::move(m_redefinedAs);
+        if ((*m_cell == m_macro) || (*m_cell == redefinedAs)) {
+            if (m_error) {
+                std::rethrow_exception(m_error);
+            }
+            return m_expansion->exec(env, tail);
+        }
+        return interpret(m_form, env);
+    }
+
+private:
+    const malValuePtr        m_form;
+    malValuePtr* const       m_cell;
+    const malValuePtr        m_macro;
+    mutable malValuePtr      m_redefinedAs;
+    const malCodePtr         m_expansion;
+    const std::exception_ptr m_error;
+};
+
+// Thrown when def! or defmacro! would add to a local frame, after its slots
+// have been handed out. The nearest enclosing scope is left to the
+// interpreter instead.
+struct LocalDefinition { };
+
+class Compiler {
+public:
+    Compiler(malEnvPtr env, bool useBytecode)
+    : m_env(env), m_useBytecode(useBytecode) { }
+
+    malCodePtr compile(malValuePtr ast, const malScope* scope, bool isTail);
+
+private:
+    malCodePtr compileList(malValuePtr ast, const malList* list,
+                           const malScope* scope, bool isTail);
+    malCodePtr compileSymbol(const malSymbol* symbol, const malScope* scope);
+    malCodePtr compileSpecial(int form, malValuePtr ast, const malList* list,
+                              const malScope* scope, bool isTail);
+    malCodePtr compileCall(malValuePtr ast, const malList* list,
+                           const malScope* scope, bool isTail);
+
+    malEnvPtr m_env;
+    bool      m_useBytecode;
+};
+
+malCodePtr Compiler::compile(malValuePtr ast, const malScope* scope,
+                             bool isTail)
+{
+    // A form which won't compile is handed to the interpreter, which will
+    // raise the same error when it's reached.
+    try {
+        if (const malList* list = DYNAMIC_CAST(malList, ast)) {
+            if (list->count() > 0) {
+                return compileList(ast, list, scope, isTail);
+            }
+        }
+        else if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, ast)) {
+            return compileSymbol(symbol, scope);
+        }
+        else if (const malVector* vector = DYNAMIC_CAST(malVector, ast)) {
+            malCodeVec items;
+            for (int i = 0, count = vector->count(); i < count; i++) {
+                items.push_back(compile(vector->item(i), scope, false));
+            }
+            return new Vector(items);
+        }
+        else if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+            // A map that's already been evaluated, such as one a macro
+            // returns, is data, as it is to the interpreter.
+            if (hash->isEvaluated()) {
+                return new Constant(ast);
+            }
+            malValuePtr keyList = hash->keys();
+            malValuePtr valueList = hash->values();
+            const malSequence* keys = STATIC_CAST(malSequence, keyList);
+            const malSequence* values = STATIC_CAST(malSequence, valueList);
+            malValueVec keyItems;
+            malCodeVec valueItems;
+            for (int i = 0, count = keys->count(); i < count; i++) {
+                keyItems.push_back(keys->item(i));
+                valueItems.push_back(compile(values->item(i), scope, false));
+            }
+            return new Hash(keyItems, valueItems);
+        }
+        return new Constant(ast);
+    }
+    catch (String&) {
+    }
+    catch (malValuePtr&) {
+    }
+    return new Interpret(ast);
+}
+
+malCodePtr Compiler::compileSymbol(const malSymbol* symbol,
+                                   const malScope* scope)
+{
+    symbol = symbol->interned();
+    for (int depth = 0; scope; scope = scope->outer, depth++) {
+        int slot = scope->slot(symbol);
+        if (slot >= 0) {
+            return new LocalRef(depth, slot, symbol);
+        }
+    }
+    return new GlobalRef(symbol);
+}
+
+static bool isLocal(const malSymbol* symbol, const malScope* scope)
+{
+    symbol = symbol->interned();
+    for (; scope; scope = scope->outer) {
+        auto end = scope->names.end();
+        if (std::find(scope->names.begin(), end, symbol) != end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+malCodePtr Compiler::compileList(malValuePtr ast, const malList* list,
+                                 const malScope* scope, bool isTail)
+{
+    malValuePtr head = list->item(0);
+    const malSymbol* symbol = DYNAMIC_CAST(malSymbol, head);
+    if (!symbol) {
+        return compileCall(ast, list, scope, isTail);
+    }
+    if (int form = symbol->specialForm()) {
+        return compileSpecial(form, ast, list, scope, isTail);
+    }
+
+    // A call to a global macro is expanded now, once. The macro is held
+    // while it runs, as it may redefine itself. An error it raises is kept
+    // for when the call is reached, rather than leaving the form to the
+    // interpreter, which would run the macro again.
+    if (!isLocal(symbol, scope)) {
+        malValuePtr* cell = m_env->globalCell(symbol);
+        malValuePtr macro = cell ? *cell : malValuePtr();
+        const malLambda* lambda = DYNAMIC_CAST(malLambda, macro);
+        if (lambda && lambda->isMacro()) {
+            malValuePtr expansion;
+            try {
+                expansion = list->applyArgs(lambda);
+            }
+            catch (String&) {
+                return new MacroCall(ast, cell, macro, NULL,
+                                     std::current_exception());
+            }
+            catch (malValuePtr&) {
+                return new MacroCall(ast, cell, macro, NULL,
+                                     std::current_exception());
+            }
+            // Kept on the form as the interpreter keeps it, so that neither
+            // it nor the VM has to run the macro again.
+            malCallSite& site = list->callSite();
+            site.expansion = expansion;
+            site.expandedBy = macro;
+            return new MacroCall(ast, cell, macro,
+                                 compile(expansion, scope, isTail));
+        }
+    }
+    return compileCall(ast, list, scope, isTail);
+}
+
+malCodePtr Compiler::compileCall(malValuePtr ast, const malList* list,
+                                 const malScope* scope, bool isTail)
+{
+    malCodePtr op = compile(list->item(0), scope, false);
+    malCodeVec args;
+    for (int i = 1, count = list->count(); i < count; i++) {
+        args.push_back(compile(list->item(i), scope, false));
+    }
+    return new Call(ast, op, args, isTail);
+}
+
+malCodePtr Compiler::compileSpecial(int form, malValuePtr ast,
+                                    const malList* list,
+                                    const malScope* scope, bool isTail)
+{
+    int argCount = list->count() - 1;
+
+    switch (form) {
+        case SpecialDef:
+        case SpecialDefMacro: {
+            bool isMacro = form == SpecialDefMacro;
+            checkArgsIs(isMacro ? "defmacro!" : "def!", 2, argCount);
+            if (scope) {
+                throw LocalDefinition();
+            }
+            const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
+            return new Def(id->interned(),
+                           compile(list->item(2), scope, false), isMacro);
+        }
+
+        case SpecialDo: {
+            checkArgsAtLeast("do", 1, argCount);
+            malCodeVec body;
+            for (int i = 1; i <= argCount; i++) {
+                body.push_back(compile(list->item(i), scope,
+                                       isTail && (i == argCount)));
+            }
+            return new Do(body);
+        }
+
+        case SpecialFn: {
+            checkArgsIs("fn*", 2, argCount);
+            static const malSymbol* ampersand =
+                STATIC_CAST(malSymbol, mal::symbol("&"));
+
+            const malSequence* bindings =
+                VALUE_CAST(malSequence, list->item(1));
+            malSymbolVec params;
+            malScope inner(scope);
+            for (int i = 0; i < bindings->count(); i++) {
+                const malSymbol* sym =
+                    VALUE_CAST(malSymbol, bindings->item(i));
+                params.push_back(sym->interned());
+                if (sym->interned() != ampersand) {
+                    inner.add(sym);
+                }
+            }
+
+            try {
+                malCodePtr body = compile(list->item(2), &inner, true);
+                if (m_useBytecode) {
+                    malCodePtr code = compileBytecode(list->item(2), &inner,
+                                                      m_env, body);
+                    if (code) {
+                        body = code;
+                    }
+                }
+                return new Fn(params, list->item(2), body);
+            }
+            catch (LocalDefinition&) {
+                return new Interpret(ast);
+            }
+        }
+
+        case SpecialIf: {
+            checkArgsBetween("if", 2, 3, argCount);
+            malCodePtr test = compile(list->item(1), scope, false);
+            malCodePtr then = compile(list->item(2), scope, isTail);
+            malCodePtr otherwise;
+            if (argCount == 3) {
+                otherwise = compile(list->item(3), scope, isTail);
+            }
+            return new If(test, then, otherwise);
+        }
+
+        case SpecialLet: {
+            checkArgsIs("let*", 2, argCount);
+            const malSequence* bindings =
+                VALUE_CAST(malSequence, list->item(1));
+            int count = checkArgsEven("let*", bindings->count());
+
+            malSymbolVec names;
+            malScope inner(scope);
+            for (int i = 0; i < count; i += 2) {
+                const malSymbol* var =
+                    VALUE_CAST(malSymbol, bindings->item(i));
+                names.push_back(var->interned());
+                inner.add(var);
+            }
+
+            try {
+                malCodeVec values;
+                for (int i = 1; i < count; i += 2) {
+                    values.push_back(compile(bindings->item(i), &inner, false));
+                }
+                malCodePtr body = compile(list->item(2), &inner, isTail);
+                return new Let(names, values, body);
+            }
+            catch (LocalDefinition&) {
+                return new Interpret(ast);
+            }
+        }
+
+        case SpecialQuasiQuote: {
+            checkArgsIs("quasiquote", 1, argCount);
+            return compile(quasiquote(list->item(1)), scope, isTail);
+        }
+
+        case SpecialQuote: {
+            checkArgsIs("quote", 1, argCount);
+            return new Constant(list->item(1));
+        }
+
+        case SpecialTry: {
+            checkArgsIs("try*", 2, argCount);
+            const malList* catchBlock = VALUE_CAST(malList, list->item(2));
+
+            checkArgsIs("catch*", 2, catchBlock->count() - 1);
+            MAL_CHECK(VALUE_CAST(malSymbol,
+                catchBlock->item(0))->value() == "catch*",
+                "catch block must begin with catch*");
+            const malSymbol* excSym =
+                VALUE_CAST(malSymbol, catchBlock->item(1));
+
+            malCodePtr body = compile(list->item(1), scope, false);
+            malScope inner(scope);
+            inner.add(excSym);
+            try {
+                malCodePtr handler =
+                    compile(catchBlock->item(2), &inner, isTail);
+                return new Try(body, excSym->interned(), handler);
+            }
+            catch (LocalDefinition&) {
+                return new Interpret(ast);
+            }
+        }
+
+        default:
+            // macroexpand works on the environment, not the form.
+            return new Interpret(ast);
+    }
+}
+
+} // namespace
+
+malCodePtr compile(malValuePtr ast, malEnvPtr env, bool useBytecode)
+{
+    return Compiler(env, useBytecode).compile(ast, NULL, true);
+}
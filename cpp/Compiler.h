@@ -0,0 +1,83 @@
+#ifndef INCLUDE_COMPILER_H
+#define INCLUDE_COMPILER_H
+
+#include "MAL.h"
+#include "Types.h"
+
+#include <algorithm>
+#include <cstdint>
+
+// Special forms are recognised by an ID on their interned symbol, so they
+// can be switched on rather than compared by name.
+enum SpecialForm {
+    NotSpecial,
+    SpecialDef,
+    SpecialDefMacro,
+    SpecialDo,
+    SpecialFn,
+    SpecialIf,
+    SpecialLet,
+    SpecialMacroExpand,
+    SpecialQuasiQuote,
+    SpecialQuote,
+    SpecialTry,
+};
+
+// The names bound by each enclosing fn*, let* and catch*, innermost first.
+// Each one is a malEnv frame at run time, with a slot for each name in the
+// order malEnv::bind adds them.
+struct malScope {
+    malScope(const malScope* outer) : outer(outer) { }
+
+    void add(const malSymbol* symbol) {
+        names.push_back(symbol->interned());
+    }
+
+    // The slot of symbol's binding, or -1 if it has none. A name bound twice
+    // means its later binding, as it does in the frame.
+    int slot(const malSymbol* symbol) const {
+        for (int i = names.size() - 1; i >= 0; i--) {
+            if (names[i] == symbol) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    const malScope* outer;
+    malSymbolVec    names;
+};
+
+// Compiler.cpp
+// Analyses a top-level form once into a tree of code, to be run in the
+// global environment env, with every symbol already resolved to a local slot
+// or a global cell. With useBytecode, fn* bodies are compiled for the VM
+// where they can be.
+extern malCodePtr compile(malValuePtr ast, malEnvPtr env, bool useBytecode);
+
+// VM.cpp
+// Compiles the body of a fn* whose parameters are bound in scope, or returns
+// NULL if it uses anything the VM doesn't handle. The VM runs fallback
+// instead if a macro it expanded has since been redefined.
+extern malCodePtr compileBytecode(malValuePtr body, const malScope* scope,
+                                  malEnvPtr env, malCodePtr fallback);
+
+// How often the VM found an enclosing local in the slot it was compiled
+// against, and how often it had to look it up by name instead. They're kept
+// here so that the earlier steps can report them without linking the VM.
+struct malVMStats {
+    uint64_t outerHits;
+    uint64_t outerMisses;
+};
+
+inline malVMStats& vmStats()
+{
+    static malVMStats stats;
+    return stats;
+}
+
+// stepA_mal.cpp
+extern malValuePtr interpret(const malValuePtr& ast, const malEnvPtr& env);
+extern malValuePtr quasiquote(malValuePtr obj);
+
+#endif // INCLUDE_COMPILER_H
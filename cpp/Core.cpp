@@ -1,5 +1,10 @@
 #include "MAL.h"
+#include "Collector.h"
+#include "Compiler.h"
 #include "Environment.h"
+#include "MappedFile.h"
+#include "Pool.h"
+#include "Reader.h"
 #include "StaticList.h"
 #include "Types.h"
 
@@ -25,6 +30,7 @@ static String printValues(malValueIter begin, malValueIter end,
 static StaticList<malBuiltIn*> handlers;
 
 #define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
+#define ARG_INT(name)   int64_t name = INTEGER_CAST(*argsBegin++)
 
 #define FUNCNAME(uniq) builtIn ## uniq
 #define HRECNAME(uniq) handler ## uniq
@@ -52,12 +58,12 @@ static StaticList<malBuiltIn*> handlers;
 #define BUILTIN_INTOP(op, checkDivByZero) \
     BUILTIN(#op) { \
         CHECK_ARGS_IS(2); \
-        ARG(malInteger, lhs); \
-        ARG(malInteger, rhs); \
+        ARG_INT(lhs); \
+        ARG_INT(rhs); \
         if (checkDivByZero) { \
-            MAL_CHECK(rhs->value() != 0, "Division by zero"); \
+            MAL_CHECK(rhs != 0, "Division by zero"); \
         } \
-        return mal::integer(lhs->value() op rhs->value()); \
+        return mal::integer(lhs op rhs); \
     }
 
 BUILTIN_ISA("atom?",        malAtom);
@@ -81,31 +87,31 @@ BUILTIN_IS("nil?",          nilValue);
 BUILTIN("-")
 {
     int argCount = CHECK_ARGS_BETWEEN(1, 2);
-    ARG(malInteger, lhs);
+    ARG_INT(lhs);
     if (argCount == 1) {
-        return mal::integer(- lhs->value());
+        return mal::integer(- lhs);
     }
 
-    ARG(malInteger, rhs);
-    return mal::integer(lhs->value() - rhs->value());
+    ARG_INT(rhs);
+    return mal::integer(lhs - rhs);
 }
 
 BUILTIN("<=")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    ARG_INT(lhs);
+    ARG_INT(rhs);
 
-    return mal::boolean(lhs->value() <= rhs->value());
+    return mal::boolean(lhs <= rhs);
 }
 
 BUILTIN("=")
 {
     CHECK_ARGS_IS(2);
-    const malValue* lhs = (*argsBegin++).ptr();
-    const malValue* rhs = (*argsBegin++).ptr();
+    malValuePtr lhs = *argsBegin++;
+    malValuePtr rhs = *argsBegin++;
 
-    return mal::boolean(lhs->isEqualTo(rhs));
+    return mal::boolean(mal::isEqual(lhs, rhs));
 }
 
 BUILTIN("apply")
@@ -128,6 +134,19 @@ BUILTIN("apply")
 BUILTIN("assoc")
 {
     CHECK_ARGS_AT_LEAST(1);
+    if (DYNAMIC_CAST(malVector, *argsBegin)) {
+        malValuePtr result = *argsBegin++;
+        MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+                  "assoc requires an even-sized list");
+
+        while (argsBegin != argsEnd) {
+            ARG_INT(i);
+            const malVector* vec = STATIC_CAST(malVector, result);
+            MAL_CHECK(i >= 0 && i <= vec->count(), "Index out of range");
+            result = vec->assoc(i, *argsBegin++);
+        }
+        return result;
+    }
     ARG(malHash, hash);
 
     return hash->assoc(argsBegin, argsEnd);
@@ -152,8 +171,9 @@ BUILTIN("concat")
     int offset = 0;
     for (auto it = argsBegin; it != argsEnd; ++it) {
         const malSequence* seq = STATIC_CAST(malSequence, *it);
-        std::copy(seq->begin(), seq->end(), items->begin() + offset);
-        offset += seq->count();
+        for (int i = 0, n = seq->count(); i < n; i++) {
+            items->at(offset++) = seq->item(i);
+        }
     }
 
     return mal::list(items);
@@ -173,11 +193,7 @@ BUILTIN("cons")
     malValuePtr first = *argsBegin++;
     ARG(malSequence, rest);
 
-    malValueVec* items = new malValueVec(1 + rest->count());
-    items->at(0) = first;
-    std::copy(rest->begin(), rest->end(), items->begin() + 1);
-
-    return mal::list(items);
+    return rest->cons(first);
 }
 
 BUILTIN("contains?")
@@ -241,6 +257,26 @@ BUILTIN("first")
     return seq->first();
 }
 
+BUILTIN("gc")
+{
+    CHECK_ARGS_IS(0);
+    return mal::integer(Collector::collect());
+}
+
+BUILTIN("gc-stats")
+{
+    CHECK_ARGS_IS(0);
+    const Collector::Stats& stats = Collector::stats();
+    malValueVec items;
+    items.push_back(mal::keyword(":collections"));
+    items.push_back(mal::integer(stats.collections));
+    items.push_back(mal::keyword(":freed-objects"));
+    items.push_back(mal::integer(stats.objects));
+    items.push_back(mal::keyword(":freed-bytes"));
+    items.push_back(mal::integer(stats.bytes));
+    return mal::hash(items.begin(), items.end(), true);
+}
+
 BUILTIN("get")
 {
     CHECK_ARGS_IS(2);
@@ -270,6 +306,23 @@ BUILTIN("keyword")
     return mal::keyword(":" + token->value());
 }
 
+BUILTIN("load-file")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malString, filename);
+
+    // Evaluate each top-level form as soon as it has been read, rather than
+    // reading the whole file into one big (do ...) first.
+    MappedFile file(filename->value());
+    Tokeniser tokeniser(file.begin(), file.end());
+
+    malValuePtr result = mal::nilValue();
+    while (!tokeniser.eof()) {
+        result = EVAL(readForm(tokeniser), NULL);
+    }
+    return result;
+}
+
 BUILTIN("meta")
 {
     CHECK_ARGS_IS(1);
@@ -282,14 +335,45 @@ BUILTIN("nth")
 {
     CHECK_ARGS_IS(2);
     ARG(malSequence, seq);
-    ARG(malInteger,  index);
+    ARG_INT(index);
 
-    int i = index->value();
+    int i = index;
     MAL_CHECK(i >= 0 && i < seq->count(), "Index out of range");
 
     return seq->item(i);
 }
 
+BUILTIN("pool-stats")
+{
+    CHECK_ARGS_IS(0);
+    const Pool::Stats& stats = Pool::stats();
+    malValueVec items;
+    items.push_back(mal::keyword(":allocations"));
+    items.push_back(mal::integer(stats.allocations));
+    items.push_back(mal::keyword(":hits"));
+    items.push_back(mal::integer(stats.hits));
+    items.push_back(mal::keyword(":large"));
+    items.push_back(mal::integer(stats.large));
+    items.push_back(mal::keyword(":resident-bytes"));
+    items.push_back(mal::integer(stats.residentBytes));
+    items.push_back(mal::keyword(":frees"));
+    items.push_back(mal::integer(stats.frees));
+    return mal::hash(items.begin(), items.end(), true);
+}
+
+#if DEBUG_REFCOUNT_TRAFFIC
+BUILTIN("refcount-stats")
+{
+    CHECK_ARGS_IS(0);
+    malValueVec items;
+    items.push_back(mal::keyword(":acquires"));
+    items.push_back(mal::integer(RefCounted::s_acquires));
+    items.push_back(mal::keyword(":releases"));
+    items.push_back(mal::integer(RefCounted::s_releases));
+    return mal::hash(items.begin(), items.end(), true);
+}
+#endif
+
 BUILTIN("pr-str")
 {
     return mal::string(printValues(argsBegin, argsEnd, " ", true));
@@ -348,8 +432,14 @@ BUILTIN("seq")
         return mal::nilValue();
     }
     if (const malSequence* seq = DYNAMIC_CAST(malSequence, arg)) {
-        return seq->isEmpty() ? mal::nilValue()
-                              : mal::list(seq->begin(), seq->end());
+        if (seq->isEmpty()) {
+            return mal::nilValue();
+        }
+        malValueVec* items = new malValueVec(seq->count());
+        for (int i = 0, n = seq->count(); i < n; i++) {
+            items->at(i) = seq->item(i);
+        }
+        return mal::list(items);
     }
     if (const malString* strVal = DYNAMIC_CAST(malString, arg)) {
         const String str = strVal->value();
@@ -443,6 +533,18 @@ BUILTIN("vector")
     return mal::vector(argsBegin, argsEnd);
 }
 
+BUILTIN("vm-stats")
+{
+    CHECK_ARGS_IS(0);
+    const malVMStats& stats = vmStats();
+    malValueVec items;
+    items.push_back(mal::keyword(":outer-hits"));
+    items.push_back(mal::integer(stats.outerHits));
+    items.push_back(mal::keyword(":outer-misses"));
+    items.push_back(mal::integer(stats.outerMisses));
+    return mal::hash(items.begin(), items.end(), true);
+}
+
 BUILTIN("with-meta")
 {
     CHECK_ARGS_IS(2);
@@ -7,6 +7,7 @@
 #define DEBUG_TRACE                    1
 //#define DEBUG_OBJECT_LIFETIMES         1
 //#define DEBUG_ENV_LIFETIMES            1
+//#define DEBUG_REFCOUNT_TRAFFIC         1
 
 #define DEBUG_TRACE_FILE    stderr
 
@@ -31,6 +32,12 @@
     #define TRACE_ENV NOTRACE
 #endif
 
+#if DEBUG_REFCOUNT_TRAFFIC
+    #define COUNT_REFCOUNT(counter) (RefCounted::counter++)
+#else
+    #define COUNT_REFCOUNT(counter) NOOP
+#endif
+
 #define _ASSERT(file, line, condition, ...) \
     if (!(condition)) { \
         printf("Assertion failed at %s(%d): ", file, line); \
@@ -1,30 +1,44 @@
 #include "Environment.h"
+#include "Collector.h"
 #include "Types.h"
 
 #include <algorithm>
+#include <utility>
+
+unsigned malEnv::s_version = 1;
 
 malEnv::malEnv(malEnvPtr outer)
-: m_outer(outer)
+: m_count(0)
+, m_outer(std::move(outer))
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    mayCloseCycles();
 }
 
-malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
+malEnv::malEnv(malEnvPtr outer, const malSymbolVec& bindings,
                malValueIter argsBegin, malValueIter argsEnd)
-: m_outer(outer)
+: m_count(0)
+, m_outer(std::move(outer))
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    mayCloseCycles();
+    static const malSymbol* ampersand =
+        STATIC_CAST(malSymbol, mal::symbol("&"));
+
     int n = bindings.size();
+    if (n > InlineBindings) {
+        m_overflow.reserve(n - InlineBindings);
+    }
     auto it = argsBegin;
     for (int i = 0; i < n; i++) {
-        if (bindings[i] == "&") {
+        if (bindings[i] == ampersand) {
             MAL_CHECK(i == n - 2, "There must be one parameter after the &");
 
-            set(bindings[n-1], mal::list(it, argsEnd));
+            bind(bindings[n-1], mal::list(it, argsEnd));
             return;
         }
         MAL_CHECK(it != argsEnd, "Not enough parameters");
-        set(bindings[i], *it);
+        bind(bindings[i], *it);
         ++it;
     }
     MAL_CHECK(it == argsEnd, "Too many parameters");
@@ -35,31 +49,176 @@ malEnv::~malEnv()
     TRACE_ENV("Destroying malEnv %p, outer=%p\n", this, m_outer.ptr());
 }
 
-malEnvPtr malEnv::find(const String& symbol)
+malEnvPtr malEnv::find(const malSymbol* symbol)
 {
+    symbol = symbol->interned();
     for (malEnvPtr env = this; env; env = env->m_outer) {
-        if (env->m_map.find(symbol) != env->m_map.end()) {
+        if (env->lookup(symbol)) {
             return env;
         }
     }
     return NULL;
 }
 
-malValuePtr malEnv::get(const String& symbol)
+malValuePtr malEnv::get(const malSymbol* symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        auto it = env->m_map.find(symbol);
-        if (it != env->m_map.end()) {
-            return it->second;
+    symbol = symbol->interned();
+    if (!symbol->isLocal()) {
+        // No frame can bind it, so only the global environment need look.
+        if (malValuePtr* value = globalCell(symbol)) {
+            return *value;
         }
+        MAL_FAIL("'%s' not found", symbol->value().c_str());
+    }
+    for (malEnv* env = this; env; env = env->m_outer.ptr()) {
+        if (malValuePtr* value = env->lookup(symbol)) {
+            return *value;
+        }
+    }
+    MAL_FAIL("'%s' not found", symbol->value().c_str());
+}
+
+malValuePtr* malEnv::globalCell(const malSymbol* symbol)
+{
+    malEnv* env = this;
+    while (env->m_outer) {
+        env = env->m_outer.ptr();
     }
-    MAL_FAIL("'%s' not found", symbol.c_str());
+    return env->lookupGlobal(symbol->interned());
 }
 
-malValuePtr malEnv::set(const String& symbol, malValuePtr value)
+malValuePtr* malEnv::local(int depth, int slot, const malSymbol* symbol)
 {
-    m_map[symbol] = value;
-    return value;
+    malEnv* env = this;
+    for (int i = 0; i < depth; i++) {
+        env = env->m_outer.ptr();
+    }
+    if (slot < env->m_count) {
+        Binding& binding = env->binding(slot);
+        if (binding.symbol == symbol) {
+            return &binding.value;
+        }
+    }
+    return NULL;
+}
+
+malValuePtr* malEnv::lookup(const malSymbol* symbol)
+{
+    if (!m_outer) {
+        return lookupGlobal(symbol);
+    }
+    // A name bound twice in a frame, as in (let* (a 1 a 2) ...), means its
+    // later binding.
+    for (auto it = m_overflow.rbegin(), end = m_overflow.rend(); it != end;
+            ++it) {
+        if (it->symbol == symbol) {
+            return &it->value;
+        }
+    }
+    for (int i = std::min<int>(m_count, InlineBindings) - 1; i >= 0; i--) {
+        if (m_inline[i].symbol == symbol) {
+            return &m_inline[i].value;
+        }
+    }
+    return NULL;
+}
+
+static size_t hashOf(const malSymbol* symbol)
+{
+    uintptr_t hash = reinterpret_cast<uintptr_t>(symbol);
+    hash ^= hash >> 17;
+    hash *= 0x9e3779b97f4a7c15;
+    return hash ^ (hash >> 32);
+}
+
+malValuePtr* malEnv::lookupGlobal(const malSymbol* symbol) const
+{
+    if (!m_globals) {
+        return NULL;
+    }
+    const Table& table = m_globals->table;
+    size_t mask = table.size() - 1;
+    for (size_t i = hashOf(symbol) & mask; ; i = (i + 1) & mask) {
+        const Slot& slot = table[i];
+        if (slot.symbol == symbol) {
+            return slot.cell;
+        }
+        if (slot.symbol == NULL) {
+            return NULL;
+        }
+    }
+}
+
+// Adds a new, empty cell for a symbol which isn't bound yet.
+malValuePtr* malEnv::insertGlobal(const malSymbol* symbol)
+{
+    if (!m_globals) {
+        m_globals.reset(new Globals);
+    }
+    Table& table = m_globals->table;
+    std::deque<malValuePtr>& cells = m_globals->cells;
+
+    // Keep the table no more than half full, so probes stay short.
+    if (2 * (cells.size() + 1) > table.size()) {
+        Table grown(table.empty() ? 256 : 2 * table.size(), Slot { });
+        size_t mask = grown.size() - 1;
+        for (auto it = table.begin(), end = table.end(); it != end; ++it) {
+            if (it->symbol) {
+                size_t i = hashOf(it->symbol) & mask;
+                while (grown[i].symbol) {
+                    i = (i + 1) & mask;
+                }
+                grown[i] = *it;
+            }
+        }
+        table.swap(grown);
+    }
+
+    cells.push_back(malValuePtr());
+    size_t mask = table.size() - 1;
+    size_t i = hashOf(symbol) & mask;
+    while (table[i].symbol) {
+        i = (i + 1) & mask;
+    }
+    table[i] = Slot { symbol, &cells.back() };
+    return &cells.back();
+}
+
+const malValuePtr& malEnv::set(const malSymbol* symbol, malValuePtr value)
+{
+    symbol = symbol->interned();
+    if (!m_outer) {
+        s_version++;
+    }
+    else {
+        symbol->markLocal();
+    }
+    if (malValuePtr* existing = lookup(symbol)) {
+        return *existing = std::move(value);
+    }
+    if (!m_outer) {
+        return *insertGlobal(symbol) = std::move(value);
+    }
+    bind(symbol, std::move(value));
+    return binding(m_count - 1).value;
+}
+
+void malEnv::bind(const malSymbol* symbol, malValuePtr value)
+{
+    symbol = symbol->interned();
+    symbol->markLocal();
+    if (m_count < InlineBindings) {
+        m_inline[m_count] = Binding { symbol, std::move(value) };
+    }
+    else {
+        m_overflow.push_back(Binding { symbol, std::move(value) });
+    }
+    m_count++;
+}
+
+const malValuePtr& malEnv::set(const String& symbol, malValuePtr value)
+{
+    return set(STATIC_CAST(malSymbol, mal::symbol(symbol)), std::move(value));
 }
 
 malEnvPtr malEnv::getRoot()
@@ -71,3 +230,11 @@ malEnvPtr malEnv::getRoot()
         }
     }
 }
+
+void malEnv::visitRefs(RefVisitor& visitor)
+{
+    for (int i = 0; i < m_count; i++) {
+        visitor(binding(i).value);
+    }
+    visitor(m_outer);
+}
@@ -3,27 +3,89 @@
 
 #include "MAL.h"
 
-#include <map>
+#include <deque>
+#include <memory>
 
 class malEnv : public RefCounted {
 public:
     malEnv(malEnvPtr outer = NULL);
     malEnv(malEnvPtr outer,
-           const StringVec& bindings,
+           const malSymbolVec& bindings,
            malValueIter argsBegin,
            malValueIter argsEnd);
 
     ~malEnv();
 
-    malValuePtr get(const String& symbol);
-    malEnvPtr   find(const String& symbol);
-    malValuePtr set(const String& symbol, malValuePtr value);
+    malValuePtr get(const malSymbol* symbol);
+    malEnvPtr   find(const malSymbol* symbol);
+    // These return the binding, which is only good until the next set.
+    const malValuePtr& set(const malSymbol* symbol, malValuePtr value);
+    const malValuePtr& set(const String& symbol, malValuePtr value);
+    // Adds a binding to a local frame as it's filled in by fn*, let* or
+    // catch*, without looking for an existing one. If the name is already
+    // bound here, the new binding hides the old one.
+    void        bind(const malSymbol* symbol, malValuePtr value);
     malEnvPtr   getRoot();
 
+    // Compiled code knows which frame and slot each local should live in.
+    // This returns NULL if symbol isn't bound there (yet).
+    malValuePtr* local(int depth, int slot, const malSymbol* symbol);
+
+    // The cell holding symbol's global binding, or NULL if it has none. The
+    // cell stays valid, and def! updates it in place.
+    malValuePtr* globalCell(const malSymbol* symbol);
+
+    // Changes whenever a global binding is added or updated, so anything
+    // cached from the global environment is stale once this moves on.
+    static unsigned version() { return s_version; }
+
+    // The global environment's own bindings aren't visited. It lives as long
+    // as the program, so it can never be part of a garbage cycle.
+    virtual void visitRefs(RefVisitor& visitor);
+
 private:
-    typedef std::map<String, malValuePtr> Map;
-    Map m_map;
-    malEnvPtr m_outer;
+    malValuePtr* lookup(const malSymbol* symbol);
+
+    malValuePtr* lookupGlobal(const malSymbol* symbol) const;
+    malValuePtr* insertGlobal(const malSymbol* symbol);
+
+    // Symbols are interned, so they can be compared by pointer. The frames
+    // made by fn* and let* only have a few bindings each, so they're kept in
+    // a flat array which is searched from the newest binding back. The first
+    // few live in the malEnv itself, so most frames need no allocation of
+    // their own.
+    struct Binding {
+        const malSymbol* symbol;
+        malValuePtr      value;
+    };
+    enum { InlineBindings = 4 };
+
+    Binding& binding(int i) {
+        return i < InlineBindings ? m_inline[i]
+                                  : m_overflow[i - InlineBindings];
+    }
+
+    // The global environment is an open-addressing table with linear
+    // probing. Each value lives in its own cell, which never moves, so def!
+    // updates a binding in place and a pointer to the cell stays valid.
+    struct Slot {
+        const malSymbol* symbol;
+        malValuePtr*     cell;
+    };
+    typedef std::vector<Slot> Table;
+
+    struct Globals {
+        Table                   table;
+        std::deque<malValuePtr> cells;
+    };
+
+    Binding                 m_inline[InlineBindings];
+    std::vector<Binding>    m_overflow;
+    int                     m_count;
+    std::unique_ptr<Globals> m_globals; // only the global environment's
+    malEnvPtr               m_outer;
+
+    static unsigned s_version;
 };
 
 #endif // INCLUDE_ENVIRONMENT_H
@@ -0,0 +1,60 @@
+#include "ArgStack.h"
+#include "EvalStack.h"
+#include "Validation.h"
+
+#include <algorithm>
+#include <pthread.h>
+
+int EvalStack::s_depth = 0;
+int EvalStack::s_limit = 10000;
+
+// A generous upper bound on the C++ stack used by one level of evaluation,
+// including any builtins and calls it makes on the way to the next. Only
+// the pages actually used are ever touched.
+static const size_t s_bytesPerLevel = 4096;
+static const size_t s_argsPerLevel = 16;
+static const size_t s_minimumStack = 8 << 20;
+
+namespace {
+struct MainArgs {
+    int (*main)(int, char*[]);
+    int argc;
+    char** argv;
+    int result;
+};
+}
+
+static void* runMain(void* arg)
+{
+    MainArgs* args = static_cast<MainArgs*>(arg);
+    args->result = args->main(args->argc, args->argv);
+    return NULL;
+}
+
+int EvalStack::run(int limit, int (*main)(int, char*[]),
+                   int argc, char* argv[])
+{
+    s_limit = limit;
+    ArgStack::reserve(limit * s_argsPerLevel);
+    size_t size = std::max(s_minimumStack, limit * s_bytesPerLevel);
+
+    MainArgs args = { main, argc, argv, 0 };
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    bool started = (pthread_attr_setstacksize(&attr, size) == 0) &&
+                   (pthread_create(&thread, &attr, runMain, &args) == 0);
+    pthread_attr_destroy(&attr);
+    if (!started) {
+        // Make do with the stack we have, which is good for the default.
+        s_limit = std::min(limit, 10000);
+        return main(argc, argv);
+    }
+    pthread_join(thread, NULL);
+    return args.result;
+}
+
+void EvalStack::overflow()
+{
+    MAL_FAIL("Maximum evaluation depth of %d exceeded", s_limit);
+}
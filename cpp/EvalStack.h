@@ -0,0 +1,32 @@
+#ifndef INCLUDE_EVALSTACK_H
+#define INCLUDE_EVALSTACK_H
+
+// Evaluation recurses on the C++ stack, so the interpreter runs on a stack
+// reserved big enough for a given depth of evaluation, and going any deeper
+// raises a mal error rather than overflowing it.
+class EvalStack {
+public:
+    // Counts one level of evaluation for as long as it's in scope.
+    class Level {
+    public:
+        Level() {
+            if (++s_depth > s_limit) {
+                --s_depth;
+                overflow();
+            }
+        }
+        ~Level() { --s_depth; }
+    };
+
+    // Runs main on a new stack, with room for limit levels.
+    static int run(int limit, int (*main)(int, char*[]),
+                   int argc, char* argv[]);
+
+private:
+    static void overflow();
+
+    static int s_depth;
+    static int s_limit;
+};
+
+#endif // INCLUDE_EVALSTACK_H
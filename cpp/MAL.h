@@ -5,19 +5,21 @@
 #include "RefCountedPtr.h"
 #include "String.h"
 #include "Validation.h"
+#include "ValuePtr.h"
 
 #include <vector>
 
-class malValue;
-typedef RefCountedPtr<malValue>  malValuePtr;
 typedef std::vector<malValuePtr> malValueVec;
 typedef malValueVec::iterator    malValueIter;
 
+class malSymbol;
+typedef std::vector<const malSymbol*> malSymbolVec;
+
 class malEnv;
 typedef RefCountedPtr<malEnv>     malEnvPtr;
 
 // step*.cpp
-extern malValuePtr APPLY(malValuePtr op,
+extern malValuePtr APPLY(const malValuePtr& op,
                          malValueIter argsBegin, malValueIter argsEnd);
 extern malValuePtr EVAL(malValuePtr ast, malEnvPtr env);
 extern malValuePtr readline(const String& prompt);
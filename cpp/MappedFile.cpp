@@ -0,0 +1,41 @@
+#include "MappedFile.h"
+#include "Validation.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const String& path)
+: m_data(NULL)
+, m_size(0)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    MAL_CHECK(fd >= 0, "Cannot open %s", path.c_str());
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        MAL_FAIL("Cannot open %s", path.c_str());
+    }
+
+    // mmap won't map an empty file, but then there's nothing to read anyway.
+    m_size = info.st_size;
+    if (m_size > 0) {
+        void* data = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        MAL_CHECK(data != MAP_FAILED, "Cannot map %s", path.c_str());
+        madvise(data, m_size, MADV_SEQUENTIAL);
+        m_data = static_cast<const char*>(data);
+    }
+    else {
+        close(fd);
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_data != NULL) {
+        munmap(const_cast<char*>(m_data), m_size);
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef INCLUDE_MAPPEDFILE_H
+#define INCLUDE_MAPPEDFILE_H
+
+#include "String.h"
+
+#include <cstddef>
+
+// A read-only memory mapping of a whole file.
+class MappedFile {
+public:
+    MappedFile(const String& path);
+    ~MappedFile();
+
+    const char* begin() const { return m_data; }
+    const char* end()   const { return m_data + m_size; }
+
+private:
+    MappedFile(const MappedFile&); // no copy ctor
+    MappedFile& operator = (const MappedFile&); // no assignments
+
+    const char* m_data;
+    size_t      m_size;
+};
+
+#endif // INCLUDE_MAPPEDFILE_H
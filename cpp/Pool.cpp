@@ -0,0 +1,75 @@
+#include "Pool.h"
+
+#include <new>
+
+namespace {
+
+// Sizes are rounded up to a multiple of Granularity, and each multiple up
+// to MaxSize has a free list of its own.
+const size_t Granularity = 16;
+const size_t MaxSize     = 256;
+const size_t ClassCount  = MaxSize / Granularity;
+const size_t ChunkSize   = 64 * 1024;
+
+struct FreeObject {
+    FreeObject* next;
+};
+
+// These are all zero-initialised, so they need no constructor and are
+// cheap to reach.
+thread_local FreeObject* t_freeLists[ClassCount];
+thread_local char*       t_chunk;
+thread_local char*       t_chunkEnd;
+thread_local Pool::Stats t_stats;
+
+}
+
+void* Pool::allocate(size_t size)
+{
+    t_stats.allocations++;
+    if ((size == 0) || (size > MaxSize)) {
+        t_stats.large++;
+        return ::operator new(size);
+    }
+
+    size_t index = (size - 1) / Granularity;
+    if (FreeObject* object = t_freeLists[index]) {
+        t_freeLists[index] = object->next;
+        t_stats.hits++;
+        return object;
+    }
+
+    size_t bytes = (index + 1) * Granularity;
+    if (t_chunk + bytes > t_chunkEnd) {
+        // Whatever is left of the old chunk is too small to use.
+        t_chunk = static_cast<char*>(::operator new(ChunkSize));
+        t_chunkEnd = t_chunk + ChunkSize;
+        t_stats.residentBytes += ChunkSize;
+    }
+    void* object = t_chunk;
+    t_chunk += bytes;
+    return object;
+}
+
+void Pool::release(void* object, size_t size)
+{
+    if (object == NULL) {
+        return;
+    }
+    t_stats.frees++;
+    t_stats.freedBytes += size;
+    if ((size == 0) || (size > MaxSize)) {
+        ::operator delete(object);
+        return;
+    }
+
+    size_t index = (size - 1) / Granularity;
+    FreeObject* freed = static_cast<FreeObject*>(object);
+    freed->next = t_freeLists[index];
+    t_freeLists[index] = freed;
+}
+
+const Pool::Stats& Pool::stats()
+{
+    return t_stats;
+}
@@ -0,0 +1,30 @@
+#ifndef INCLUDE_POOL_H
+#define INCLUDE_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Small refcounted objects - values, environments, and the nodes within
+// them - come from free lists kept for each size class, rather than from
+// the global allocator. Each thread has its own, so no locking is needed.
+// Memory is carved from chunks which are never given back, so an object
+// can be freed on a different thread from the one which allocated it.
+class Pool {
+public:
+    static void* allocate(size_t size);
+    static void  release(void* object, size_t size);
+
+    struct Stats {
+        uint64_t allocations;   // objects allocated
+        uint64_t hits;          // ... which reused a freed object
+        uint64_t large;         // ... which were too big for the pool
+        uint64_t residentBytes; // held in chunks, in use or free
+        uint64_t frees;         // objects freed
+        uint64_t freedBytes;    // ... and their sizes
+    };
+
+    // The counters for this thread.
+    static const Stats& stats();
+};
+
+#endif // INCLUDE_POOL_H
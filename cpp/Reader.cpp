@@ -1,122 +1,166 @@
 #include "MAL.h"
+#include "Reader.h"
 #include "Types.h"
 
-#include <regex>
+#include <memory>
 
-typedef std::regex              Regex;
-
-static const Regex intRegex("^[-+]?\\d+$");
-static const Regex closeRegex("[\\)\\]}]");
-
-static const Regex whitespaceRegex("[\\s,]+|;.*");
-static const Regex tokenRegexes[] = {
-    Regex("~@"),
-    Regex("[\\[\\]{}()'`~^@]"),
-    Regex("\"(?:\\\\.|[^\\\\\"])*\""),
-    Regex("[^\\s\\[\\]{}('\"`,;)]+"),
-};
-
-class Tokeniser
+// Tokens are classified by their first character. Whitespace is [\s,],
+// comments run from ; to the end of the line, and an atom is a run of
+// anything other than whitespace or [\[\]{}('"`,;)].
+static bool isLineEnd(char c)
 {
-public:
-    Tokeniser(const String& input);
-
-    String peek() const {
-        ASSERT(!eof(), "Tokeniser reading past EOF in peek\n");
-        return m_token;
-    }
-
-    String next() {
-        ASSERT(!eof(), "Tokeniser reading past EOF in next\n");
-        String ret = peek();
-        nextToken();
-        return ret;
-    }
+    return (c == '\n') || (c == '\r');
+}
 
-    bool eof() const {
-        return m_iter == m_end;
+static bool isWhitespace(char c)
+{
+    switch (c) {
+        case ' ': case '\t': case '\n': case '\v': case '\f': case '\r':
+        case ',':
+            return true;
+        default:
+            return false;
     }
+}
 
-private:
-    void skipWhitespace();
-    void nextToken();
-
-    bool matchRegex(const Regex& regex);
-
-    typedef String::const_iterator StringIter;
-
-    String      m_token;
-    StringIter  m_iter;
-    StringIter  m_end;
-};
-
-Tokeniser::Tokeniser(const String& input)
-:   m_iter(input.begin())
-,   m_end(input.end())
+static bool isAtomChar(char c)
 {
-    nextToken();
+    switch (c) {
+        case '[': case ']': case '{': case '}': case '(': case ')':
+        case '\'': case '"': case '`': case ';':
+            return false;
+        default:
+            return !isWhitespace(c);
+    }
 }
 
-bool Tokeniser::matchRegex(const Regex& regex)
+static bool isCloser(const StringSlice& token)
 {
-    if (eof()) {
+    if (token.size() != 1) {
         return false;
     }
+    switch (token[0]) {
+        case ')': case ']': case '}':
+            return true;
+        default:
+            return false;
+    }
+}
 
-    std::smatch match;
-    auto flags = std::regex_constants::match_continuous;
-    if (!std::regex_search(m_iter, m_end, match, regex, flags)) {
+static bool isInteger(const StringSlice& token)
+{
+    auto it = token.begin(), end = token.end();
+    if ((it != end) && ((*it == '-') || (*it == '+'))) {
+        ++it;
+    }
+    if (it == end) {
         return false;
     }
+    for ( ; it != end; ++it) {
+        if ((*it < '0') || (*it > '9')) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    ASSERT(match.size() == 1, "Should only have one submatch, not %lu\n",
-                              match.size());
-    ASSERT(match.position(0) == 0, "Need to match first character\n");
-    ASSERT(match.length(0) > 0, "Need to match a non-empty string\n");
+Tokeniser::Tokeniser(const char* begin, const char* end)
+:   m_token(begin, begin)
+,   m_iter(begin)
+,   m_end(end)
+{
+    nextToken();
+}
 
-    // Don't advance  m_iter now, do it after we've consumed the token in
-    // next().  If we do it now, we hit eof() when there's still one token left.
-    m_token = match.str(0);
+Tokeniser::Tokeniser(const String& input)
+:   Tokeniser(input.data(), input.data() + input.size())
+{
 
-    return true;
 }
 
 void Tokeniser::nextToken()
 {
-    m_iter += m_token.size();
+    // Don't advance m_iter until the token has been consumed in next().
+    // If we do it earlier, we hit eof() when there's still one token left.
+    m_iter = m_token.end();
 
     skipWhitespace();
     if (eof()) {
         return;
     }
 
-    for (auto &it : tokenRegexes) {
-        if (matchRegex(it)) {
-            return;
-        }
+    StringIter start = m_iter;
+    StringIter it = start + 1;
+    switch (*start) {
+        case '~':
+            if ((it != m_end) && (*it == '@')) {
+                ++it;
+            }
+            break;
+
+        case '[': case ']': case '{': case '}': case '(': case ')':
+        case '\'': case '`': case '^': case '@':
+            break;
+
+        case '"':
+            it = scanString(it);
+            break;
+
+        default:
+            it = scanAtom(it);
+            break;
     }
+    m_token = StringSlice(start, it);
+}
 
-    String mismatch(m_iter, m_end);
-    if (mismatch[0] == '"') {
-        MAL_CHECK(false, "Expected \", got EOF");
+Tokeniser::StringIter Tokeniser::scanString(StringIter it) const
+{
+    // The opening quote has already been consumed.
+    while (1) {
+        MAL_CHECK(it != m_end, "Expected \", got EOF");
+        char c = *it++;
+        if (c == '"') {
+            return it;
+        }
+        if (c == '\\') {
+            // A backslash escapes anything but a line ending.
+            MAL_CHECK((it != m_end) && !isLineEnd(*it),
+                      "Expected \", got EOF");
+            ++it;
+        }
     }
-    else {
-        MAL_CHECK(false, "Unexpected \"%s\"", mismatch.c_str());
+}
+
+Tokeniser::StringIter Tokeniser::scanAtom(StringIter it) const
+{
+    while ((it != m_end) && isAtomChar(*it)) {
+        ++it;
     }
+    return it;
 }
 
 void Tokeniser::skipWhitespace()
 {
-    while (matchRegex(whitespaceRegex)) {
-        m_iter += m_token.size();
+    while (m_iter != m_end) {
+        char c = *m_iter;
+        if (c == ';') {
+            while ((m_iter != m_end) && !isLineEnd(*m_iter)) {
+                ++m_iter;
+            }
+        }
+        else if (isWhitespace(c)) {
+            ++m_iter;
+        }
+        else {
+            break;
+        }
     }
 }
 
 static malValuePtr readAtom(Tokeniser& tokeniser);
-static malValuePtr readForm(Tokeniser& tokeniser);
 static void readList(Tokeniser& tokeniser, malValueVec* items,
-                      const String& end);
-static malValuePtr processMacro(Tokeniser& tokeniser, const String& symbol);
+                      const char* end);
+static malValuePtr processMacro(Tokeniser& tokeniser, const char* symbol);
 
 malValuePtr readStr(const String& input)
 {
@@ -127,13 +171,13 @@ malValuePtr readStr(const String& input)
     return readForm(tokeniser);
 }
 
-static malValuePtr readForm(Tokeniser& tokeniser)
+malValuePtr readForm(Tokeniser& tokeniser)
 {
     MAL_CHECK(!tokeniser.eof(), "Expected form, got EOF");
-    String token = tokeniser.peek();
+    StringSlice token = tokeniser.peek();
 
-    MAL_CHECK(!std::regex_match(token, closeRegex),
-            "Unexpected \"%s\"", token.c_str());
+    MAL_CHECK(!isCloser(token),
+            "Unexpected \"%s\"", token.str().c_str());
 
     if (token == "(") {
         tokeniser.next();
@@ -162,7 +206,7 @@ static malValuePtr readAtom(Tokeniser& tokeniser)
         const char* token;
         const char* symbol;
     };
-    ReaderMacro macroTable[] = {
+    static const ReaderMacro macroTable[] = {
         { "@",   "deref" },
         { "`",   "quasiquote" },
         { "'",   "quote" },
@@ -174,18 +218,18 @@ static malValuePtr readAtom(Tokeniser& tokeniser)
         const char* token;
         malValuePtr value;
     };
-    Constant constantTable[] = {
+    static const Constant constantTable[] = {
         { "false",  mal::falseValue()  },
         { "nil",    mal::nilValue()          },
         { "true",   mal::trueValue()   },
     };
 
-    String token = tokeniser.next();
+    StringSlice token = tokeniser.next();
     if (token[0] == '"') {
         return mal::string(unescape(token));
     }
     if (token[0] == ':') {
-        return mal::keyword(token);
+        return mal::keyword(token.str());
     }
     if (token == "^") {
         malValuePtr meta = readForm(tokeniser);
@@ -203,17 +247,17 @@ static malValuePtr readAtom(Tokeniser& tokeniser)
             return processMacro(tokeniser, macro.symbol);
         }
     }
-    if (std::regex_match(token, intRegex)) {
-        return mal::integer(token);
+    if (isInteger(token)) {
+        return mal::integer(token.str());
     }
-    return mal::symbol(token);
+    return mal::symbol(token.str());
 }
 
 static void readList(Tokeniser& tokeniser, malValueVec* items,
-                      const String& end)
+                      const char* end)
 {
     while (1) {
-        MAL_CHECK(!tokeniser.eof(), "Expected \"%s\", got EOF", end.c_str());
+        MAL_CHECK(!tokeniser.eof(), "Expected \"%s\", got EOF", end);
         if (tokeniser.peek() == end) {
             tokeniser.next();
             return;
@@ -222,7 +266,7 @@ static void readList(Tokeniser& tokeniser, malValueVec* items,
     }
 }
 
-static malValuePtr processMacro(Tokeniser& tokeniser, const String& symbol)
+static malValuePtr processMacro(Tokeniser& tokeniser, const char* symbol)
 {
     return mal::list(mal::symbol(symbol), readForm(tokeniser));
 }
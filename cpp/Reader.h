@@ -0,0 +1,47 @@
+#ifndef INCLUDE_READER_H
+#define INCLUDE_READER_H
+
+#include "MAL.h"
+
+class Tokeniser
+{
+public:
+    Tokeniser(const char* begin, const char* end);
+    Tokeniser(const String& input);
+
+    // Tokens are slices of the input buffer, so they are only valid for as
+    // long as the input is.
+    StringSlice peek() const {
+        ASSERT(!eof(), "Tokeniser reading past EOF in peek\n");
+        return m_token;
+    }
+
+    StringSlice next() {
+        ASSERT(!eof(), "Tokeniser reading past EOF in next\n");
+        StringSlice ret = peek();
+        nextToken();
+        return ret;
+    }
+
+    bool eof() const {
+        return m_iter == m_end;
+    }
+
+private:
+    void skipWhitespace();
+    void nextToken();
+
+    typedef StringSlice::Iter StringIter;
+
+    StringIter scanString(StringIter it) const;
+    StringIter scanAtom(StringIter it) const;
+
+    StringSlice m_token;
+    StringIter  m_iter;
+    StringIter  m_end;
+};
+
+// Reads a single form, leaving the tokeniser at the start of the next one.
+extern malValuePtr readForm(Tokeniser& tokeniser);
+
+#endif // INCLUDE_READER_H
@@ -2,23 +2,91 @@
 #define INCLUDE_REFCOUNTEDPTR_H
 
 #include "Debug.h"
+#include "Pool.h"
 
 #include <cstddef>
+#include <utility>
+
+class RefVisitor;
 
 class RefCounted {
 public:
-    RefCounted() : m_refCount(0) { }
-    virtual ~RefCounted() { }
+    RefCounted() : m_refCount(0), m_rootIndex(NotACandidate) { }
+    virtual ~RefCounted() {
+        if (m_rootIndex >= 0) {
+            forgetRoot();
+        }
+    }
 
-    const RefCounted* acquire() const { m_refCount++; return this; }
-    int release() const { return --m_refCount; }
+    const RefCounted* acquire() const {
+        COUNT_REFCOUNT(s_acquires);
+        m_refCount++;
+        return this;
+    }
+    void release() const {
+        COUNT_REFCOUNT(s_releases);
+        if (--m_refCount == 0) {
+            destroy();
+        }
+        else if (m_rootIndex == NotBuffered) {
+            bufferRoot();
+        }
+    }
     int refCount() const { return m_refCount; }
 
+    // Passes each reference this holds to visitor, so that the Collector can
+    // find cycles and break them. Leaving a reference out only means that
+    // cycles through it are never collected.
+    virtual void visitRefs(RefVisitor& visitor) { }
+
+    static void* operator new(size_t size) {
+        if (s_destroyLater) {
+            destroyPending(s_destroySlice);
+        }
+        return Pool::allocate(size);
+    }
+    static void operator delete(void* object, size_t size) {
+        Pool::release(object, size);
+    }
+
+    // An object is freed by a loop over a work-list, not by recursing into
+    // the objects its destructor releases, so dropping a deeply nested
+    // structure can't overflow the stack. Normally the whole list is worked
+    // through at once. With a slice size set, only that many objects are
+    // freed at a time, and the rest a slice at each later allocation.
+    static void setDestroySlice(size_t objects);
+
+#if DEBUG_REFCOUNT_TRAFFIC
+    // Every acquire and release, to measure how much refcounting the
+    // interpreter does.
+    static uint64_t s_acquires;
+    static uint64_t s_releases;
+#endif
+
+protected:
+    // Every cycle passes through an object of a type which calls this from
+    // its constructor, so the Collector need only start looking from them.
+    void mayCloseCycles() { m_rootIndex = NotBuffered; }
+
 private:
+    friend class Collector;
+
     RefCounted(const RefCounted&); // no copy ctor
     RefCounted& operator = (const RefCounted&); // no assignments
 
+    // Collector.cpp
+    void bufferRoot() const;
+    void forgetRoot() const;
+    void destroy() const;
+    static void destroyPending(size_t limit);
+
+    static bool   s_destroyLater; // objects are waiting for a later slice
+    static size_t s_destroySlice;
+
+    enum { NotACandidate = -2, NotBuffered = -1 };
+
     mutable int m_refCount;
+    mutable int m_rootIndex; // in the Collector's possible roots, if >= 0
 };
 
 template<class T>
@@ -32,11 +100,23 @@ public:
     RefCountedPtr(const RefCountedPtr& rhs) : m_object(0)
     { acquire(rhs.m_object); }
 
+    // Moving hands the reference over, without touching the count.
+    RefCountedPtr(RefCountedPtr&& rhs) noexcept : m_object(rhs.m_object)
+    { rhs.m_object = 0; }
+
     const RefCountedPtr& operator = (const RefCountedPtr& rhs) {
         acquire(rhs.m_object);
         return *this;
     }
 
+    const RefCountedPtr& operator = (RefCountedPtr&& rhs) noexcept {
+        T* object = rhs.m_object;
+        rhs.m_object = 0;
+        release();
+        m_object = object;
+        return *this;
+    }
+
     bool operator == (const RefCountedPtr& rhs) const {
         return m_object == rhs.m_object;
     }
@@ -66,12 +146,47 @@ private:
     }
 
     void release() {
-        if ((m_object != NULL) && (m_object->release() == 0)) {
-            delete m_object;
+        if (m_object != NULL) {
+            m_object->release();
         }
     }
 
     T* m_object;
 };
 
+// Stands in for a smart pointer of type T which starts off borrowed from
+// the caller, so it costs no refcounting. Only when it's given another value
+// does it take a reference of its own. This suits loops like EVAL's, which
+// usually return before a tail call replaces what they were given.
+template<class T>
+class BorrowedPtr {
+public:
+    BorrowedPtr(const T& borrowed) : m_ref(&borrowed) { }
+
+    BorrowedPtr& operator = (const T& rhs) {
+        m_owned = rhs;
+        m_ref = &m_owned;
+        return *this;
+    }
+
+    BorrowedPtr& operator = (T&& rhs) {
+        m_owned = std::move(rhs);
+        m_ref = &m_owned;
+        return *this;
+    }
+
+    operator const T& () const { return *m_ref; }
+    const T& operator -> () const { return *m_ref; }
+    auto ptr() const -> decltype(std::declval<const T&>().ptr()) {
+        return m_ref->ptr();
+    }
+
+private:
+    BorrowedPtr(const BorrowedPtr&); // no copy ctor
+    BorrowedPtr& operator = (const BorrowedPtr&); // no assignments
+
+    const T* m_ref;
+    T        m_owned;
+};
+
 #endif // INCLUDE_REFCOUNTEDPTR_H
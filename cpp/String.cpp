@@ -64,7 +64,7 @@ static char unescape(char c)
     }
 }
 
-String unescape(const String& in)
+String unescape(const StringSlice& in)
 {
     String out;
     out.reserve(in.size()); // unescaped string will always be shorter
@@ -2,17 +2,49 @@
 #define INCLUDE_STRING_H
 
 #include <string>
+#include <string.h>
 #include <vector>
 
 typedef std::string         String;
 typedef std::vector<String> StringVec;
 
+// A non-owning view of a range of characters within some other buffer.
+// The underlying buffer must outlive the slice.
+class StringSlice {
+public:
+    typedef const char* Iter;
+
+    StringSlice() : m_begin(NULL), m_end(NULL) { }
+    StringSlice(Iter begin, Iter end) : m_begin(begin), m_end(end) { }
+    StringSlice(const String& s)
+        : m_begin(s.data()), m_end(s.data() + s.size()) { }
+
+    Iter begin() const { return m_begin; }
+    Iter end()   const { return m_end; }
+    int  size()  const { return m_end - m_begin; }
+    bool empty() const { return m_begin == m_end; }
+    char operator [] (int index) const { return m_begin[index]; }
+
+    String str() const { return String(m_begin, m_end); }
+
+    bool operator == (const char* s) const {
+        size_t length = strlen(s);
+        return (length == (size_t)size())
+            && (memcmp(m_begin, s, length) == 0);
+    }
+    bool operator != (const char* s) const { return !(*this == s); }
+
+private:
+    Iter m_begin;
+    Iter m_end;
+};
+
 #define STRF        stringPrintf
 #define PLURAL(n)   &("s"[(n)==1])
 
 extern String stringPrintf(const char* fmt, ...);
 extern String copyAndFree(char* mallocedString);
 extern String escape(const String& s);
-extern String unescape(const String& s);
+extern String unescape(const StringSlice& s);
 
 #endif // INCLUDE_STRING_H
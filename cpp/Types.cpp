@@ -1,10 +1,35 @@
+#include "ArgStack.h"
+#include "Collector.h"
 #include "Debug.h"
 #include "Environment.h"
+#include "EvalStack.h"
 #include "Types.h"
 
 #include <algorithm>
 #include <memory>
-#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+
+#if DEBUG_REFCOUNT_TRAFFIC
+uint64_t RefCounted::s_acquires = 0;
+uint64_t RefCounted::s_releases = 0;
+#endif
+
+// Interned values are never freed, so the table holds a reference to each.
+template<class T>
+static malValuePtr intern(const String& token)
+{
+    typedef std::unordered_map<String, malValuePtr> Table;
+    static Table table;
+
+    auto it = table.find(token);
+    if (it != table.end()) {
+        return it->second;
+    }
+    malValuePtr value(new T(token));
+    table.insert(Table::value_type(token, value));
+    return value;
+}
 
 namespace mal {
     malValuePtr atom(malValuePtr value) {
@@ -20,13 +45,13 @@ namespace mal {
     };
 
     malValuePtr falseValue() {
-        static malValuePtr c(new malConstant("false"));
-        return malValuePtr(c);
+        static malValuePtr c(malValuePtr::unmanaged(new malConstant("false")));
+        return c;
     };
 
 
-    malValuePtr hash(const malHash::Map& map) {
-        return malValuePtr(new malHash(map));
+    malValuePtr hash(malHashNodePtr root, int count) {
+        return malValuePtr(new malHash(root, count));
     }
 
     malValuePtr hash(malValueIter argsBegin, malValueIter argsEnd,
@@ -35,20 +60,23 @@ namespace mal {
     }
 
     malValuePtr integer(int64_t value) {
-        return malValuePtr(new malInteger(value));
+        return malValuePtr::isImmediate(value)
+            ? malValuePtr::integer(value)
+            : malValuePtr(new malInteger(value));
     };
 
     malValuePtr integer(const String& token) {
-        return integer(std::stoi(token));
+        return integer(std::stoll(token));
     };
 
     malValuePtr keyword(const String& token) {
-        return malValuePtr(new malKeyword(token));
+        return intern<malKeyword>(token);
     };
 
-    malValuePtr lambda(const StringVec& bindings,
-                       malValuePtr body, malEnvPtr env) {
-        return malValuePtr(new malLambda(bindings, body, env));
+    malValuePtr lambda(const malSymbolVec& bindings,
+                       malValuePtr body, malEnvPtr env, malCodePtr code) {
+        return malValuePtr(new malLambda(bindings, std::move(body),
+                                         std::move(env), std::move(code)));
     }
 
     malValuePtr list(malValueVec* items) {
@@ -85,8 +113,8 @@ namespace mal {
     };
 
     malValuePtr nilValue() {
-        static malValuePtr c(new malConstant("nil"));
-        return malValuePtr(c);
+        static malValuePtr c(malValuePtr::unmanaged(new malConstant("nil")));
+        return c;
     };
 
     malValuePtr string(const String& token) {
@@ -94,12 +122,12 @@ namespace mal {
     }
 
     malValuePtr symbol(const String& token) {
-        return malValuePtr(new malSymbol(token));
+        return intern<malSymbol>(token);
     };
 
     malValuePtr trueValue() {
-        static malValuePtr c(new malConstant("true"));
-        return malValuePtr(c);
+        static malValuePtr c(malValuePtr::unmanaged(new malConstant("true")));
+        return c;
     };
 
     malValuePtr vector(malValueVec* items) {
@@ -117,47 +145,51 @@ malValuePtr malBuiltIn::apply(malValueIter argsBegin,
     return m_handler(m_name, argsBegin, argsEnd);
 }
 
-static String makeHashKey(malValuePtr key)
+// Checks that key can be used in a hash map, and returns its hash.
+static uint32_t hashOf(const malValuePtr& key)
 {
-    if (const malString* skey = DYNAMIC_CAST(malString, key)) {
-        return skey->print(true);
-    }
-    else if (const malKeyword* kkey = DYNAMIC_CAST(malKeyword, key)) {
-        return kkey->print(true);
-    }
-    MAL_FAIL("%s is not a string or keyword", key->print(true).c_str());
+    const malStringBase* hashKey = DYNAMIC_CAST(malStringBase, key);
+    MAL_CHECK(hashKey && !DYNAMIC_CAST(malSymbol, key),
+              "%s is not a string or keyword", key->print(true).c_str());
+    return hashKey->hash();
 }
 
-static malHash::Map addToMap(malHash::Map& map,
+static bool isSameKey(const malHashNode::Entry& entry, const malValuePtr& key)
+{
+    return (entry.key == key) || entry.key->isEqualTo(key.ptr());
+}
+
+static void addToMap(malHashNodePtr& root, int& count,
     malValueIter argsBegin, malValueIter argsEnd)
 {
     // This is intended to be called with pre-evaluated arguments.
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it++);
-        map[key] = *it;
+        malValuePtr key = *it++;
+        uint32_t hash = hashOf(key);
+        bool added = false;
+        root = root ? root->assoc(key, hash, 0, *it, added)
+                    : malHashNode().assoc(key, hash, 0, *it, added);
+        if (added) {
+            count++;
+        }
     }
-
-    return map;
-}
-
-static malHash::Map createMap(malValueIter argsBegin, malValueIter argsEnd)
-{
-    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
-            "hash-map requires an even-sized list");
-
-    malHash::Map map;
-    return addToMap(map, argsBegin, argsEnd);
 }
 
 malHash::malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated)
-: m_map(createMap(argsBegin, argsEnd))
+: malValue(HASH)
+, m_count(0)
 , m_isEvaluated(isEvaluated)
 {
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "hash-map requires an even-sized list");
 
+    addToMap(m_root, m_count, argsBegin, argsEnd);
 }
 
-malHash::malHash(const malHash::Map& map)
-: m_map(map)
+malHash::malHash(malHashNodePtr root, int count)
+: malValue(HASH)
+, m_root(root)
+, m_count(count)
 , m_isEvaluated(true)
 {
 
@@ -169,82 +201,103 @@ malHash::assoc(malValueIter argsBegin, malValueIter argsEnd) const
     MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
             "assoc requires an even-sized list");
 
-    malHash::Map map(m_map);
-    return mal::hash(addToMap(map, argsBegin, argsEnd));
+    malHashNodePtr root = m_root;
+    int count = m_count;
+    addToMap(root, count, argsBegin, argsEnd);
+    return mal::hash(root, count);
 }
 
 bool malHash::contains(malValuePtr key) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it != m_map.end();
+    uint32_t hash = hashOf(key);
+    return m_root && m_root->find(key, hash, 0);
 }
 
 malValuePtr
 malHash::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    malHash::Map map(m_map);
+    malHashNodePtr root = m_root;
+    int count = m_count;
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it);
-        map.erase(key);
+        uint32_t hash = hashOf(*it);
+        if (root) {
+            malHashNodePtr next = root->dissoc(*it, hash, 0);
+            if (next != root) {
+                root = next;
+                count--;
+            }
+        }
     }
-    return mal::hash(map);
+    return mal::hash(root, count);
 }
 
-malValuePtr malHash::eval(malEnvPtr env)
+malValuePtr malHash::eval(const malEnvPtr& env)
 {
     if (m_isEvaluated) {
         return malValuePtr(this);
     }
 
-    malHash::Map map;
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        map[it->first] = EVAL(it->second, env);
+    malHashNodePtr root;
+    int count = 0;
+    if (m_root) {
+        m_root->forEach([&](const malHashNode::Entry& entry) {
+            bool added = false;
+            uint32_t hash = hashOf(entry.key);
+            malValuePtr value = EVAL(entry.value, env);
+            root = root ? root->assoc(entry.key, hash, 0, value, added)
+                        : malHashNode().assoc(entry.key, hash, 0, value,
+                                              added);
+            count++;
+        });
     }
-    return mal::hash(map);
+    return mal::hash(root, count);
 }
 
 malValuePtr malHash::get(malValuePtr key) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it == m_map.end() ? mal::nilValue() : it->second;
+    uint32_t hash = hashOf(key);
+    const malValuePtr* value = m_root ? m_root->find(key, hash, 0) : NULL;
+    return value ? *value : mal::nilValue();
 }
 
 malValuePtr malHash::keys() const
 {
     malValueVec* keys = new malValueVec();
-    keys->reserve(m_map.size());
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        if (it->first[0] == '"') {
-            keys->push_back(mal::string(unescape(it->first)));
-        }
-        else {
-            keys->push_back(mal::keyword(it->first));
-        }
+    keys->reserve(m_count);
+    if (m_root) {
+        m_root->forEach([=](const malHashNode::Entry& entry) {
+            keys->push_back(entry.key);
+        });
     }
     return mal::list(keys);
 }
 
 malValuePtr malHash::values() const
 {
-    malValueVec* keys = new malValueVec();
-    keys->reserve(m_map.size());
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        keys->push_back(it->second);
+    malValueVec* values = new malValueVec();
+    values->reserve(m_count);
+    if (m_root) {
+        m_root->forEach([=](const malHashNode::Entry& entry) {
+            values->push_back(entry.value);
+        });
     }
-    return mal::list(keys);
+    return mal::list(values);
 }
 
 String malHash::print(bool readably) const
 {
     String s = "{";
 
-    auto it = m_map.begin(), end = m_map.end();
-    if (it != end) {
-        s += it->first + " " + it->second->print(readably);
-        ++it;
-    }
-    for ( ; it != end; ++it) {
-        s += " " + it->first + " " + it->second->print(readably);
+    if (m_root) {
+        bool first = true;
+        m_root->forEach([&](const malHashNode::Entry& entry) {
+            if (!first) {
+                s += " ";
+            }
+            first = false;
+            s += entry.key->print(readably) + " "
+               + entry.value->print(readably);
+        });
     }
 
     return s + "}";
@@ -252,49 +305,237 @@ String malHash::print(bool readably) const
 
 bool malHash::doIsEqualTo(const malValue* rhs) const
 {
-    const malHash::Map& r_map = static_cast<const malHash*>(rhs)->m_map;
-    if (m_map.size() != r_map.size()) {
+    const malHash* rhsHash = static_cast<const malHash*>(rhs);
+    if (m_count != rhsHash->m_count) {
         return false;
     }
+    if (m_count == 0) {
+        return true;
+    }
+    return malHashNode::isEqual(m_root.ptr(), rhsHash->m_root.ptr(), 0);
+}
+
+void malHash::visitRefs(RefVisitor& visitor)
+{
+    malValue::visitRefs(visitor);
+    visitor(m_root);
+}
+
+const malValuePtr*
+malHashNode::find(const malValuePtr& key, uint32_t hash, int shift) const
+{
+    if (shift >= HashBits) {
+        int index = collisionIndexOf(key);
+        return index < 0 ? NULL : &m_entries[index].value;
+    }
 
-    for (auto it0 = m_map.begin(), end0 = m_map.end(), it1 = r_map.begin();
-         it0 != end0; ++it0, ++it1) {
+    uint32_t bit = 1u << ((hash >> shift) & Mask);
+    if ((m_bitmap & bit) == 0) {
+        return NULL;
+    }
+    const Entry& entry = m_entries[indexOf(bit)];
+    if (entry.child) {
+        return entry.child->find(key, hash, shift + Bits);
+    }
+    return isSameKey(entry, key) ? &entry.value : NULL;
+}
 
-        if (it0->first != it1->first) {
+malHashNodePtr malHashNode::assoc(const malValuePtr& key, uint32_t hash,
+                                  int shift, malValuePtr value,
+                                  bool& added) const
+{
+    if (shift >= HashBits) {
+        malHashNodePtr node(new malHashNode(this));
+        int index = collisionIndexOf(key);
+        if (index < 0) {
+            node->m_entries.push_back(Entry { key, value, Ptr() });
+            added = true;
+        }
+        else {
+            node->m_entries[index].value = value;
+        }
+        return node;
+    }
+
+    uint32_t bit = 1u << ((hash >> shift) & Mask);
+    int index = indexOf(bit);
+    if ((m_bitmap & bit) == 0) {
+        malHashNodePtr node(new malHashNode(this));
+        node->m_entries.insert(node->m_entries.begin() + index,
+                               Entry { key, value, Ptr() });
+        node->m_bitmap |= bit;
+        added = true;
+        return node;
+    }
+
+    const Entry& entry = m_entries[index];
+    malHashNodePtr child;
+    if (entry.child) {
+        child = entry.child->assoc(key, hash, shift + Bits, value, added);
+        if (child == entry.child) {
+            return const_cast<malHashNode*>(this);
+        }
+    }
+    else if (isSameKey(entry, key)) {
+        if (entry.value == value) {
+            return const_cast<malHashNode*>(this);
+        }
+        malHashNodePtr node(new malHashNode(this));
+        node->m_entries[index].value = value;
+        return node;
+    }
+    else {
+        // Two keys share this slot, so they move down into a new child.
+        bool ignored;
+        child = malHashNode().assoc(entry.key, hashOf(entry.key),
+                                    shift + Bits, entry.value, ignored);
+        child = child->assoc(key, hash, shift + Bits, value, added);
+    }
+
+    malHashNodePtr node(new malHashNode(this));
+    node->m_entries[index] = Entry { malValuePtr(), malValuePtr(), child };
+    return node;
+}
+
+malHashNodePtr
+malHashNode::dissoc(const malValuePtr& key, uint32_t hash, int shift) const
+{
+    if (shift >= HashBits) {
+        int index = collisionIndexOf(key);
+        if (index < 0) {
+            return const_cast<malHashNode*>(this);
+        }
+        if (m_entries.size() == 1) {
+            return NULL;
+        }
+        malHashNodePtr node(new malHashNode(this));
+        node->m_entries.erase(node->m_entries.begin() + index);
+        return node;
+    }
+
+    uint32_t bit = 1u << ((hash >> shift) & Mask);
+    if ((m_bitmap & bit) == 0) {
+        return const_cast<malHashNode*>(this);
+    }
+    int index = indexOf(bit);
+    const Entry& entry = m_entries[index];
+    if (entry.child) {
+        malHashNodePtr child = entry.child->dissoc(key, hash, shift + Bits);
+        if (child == entry.child) {
+            return const_cast<malHashNode*>(this);
+        }
+        // Children hold at least two keys, so a single key moves back up.
+        malHashNodePtr node(new malHashNode(this));
+        if ((child->m_entries.size() == 1) && !child->m_entries[0].child) {
+            node->m_entries[index] = child->m_entries[0];
+        }
+        else {
+            node->m_entries[index].child = child;
+        }
+        return node;
+    }
+    if (!isSameKey(entry, key)) {
+        return const_cast<malHashNode*>(this);
+    }
+    if (m_entries.size() == 1) {
+        return NULL;
+    }
+    malHashNodePtr node(new malHashNode(this));
+    node->m_entries.erase(node->m_entries.begin() + index);
+    node->m_bitmap &= ~bit;
+    return node;
+}
+
+int malHashNode::collisionIndexOf(const malValuePtr& key) const
+{
+    for (int i = 0, count = m_entries.size(); i < count; i++) {
+        if (isSameKey(m_entries[i], key)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool malHashNode::isEqual(const malHashNode* lhs, const malHashNode* rhs,
+                          int shift)
+{
+    if (lhs == rhs) {
+        return true; // a shared subtree
+    }
+
+    if (shift >= HashBits) {
+        if (lhs->m_entries.size() != rhs->m_entries.size()) {
             return false;
         }
-        if (!it0->second->isEqualTo(it1->second.ptr())) {
+        for (auto it = lhs->m_entries.begin(), end = lhs->m_entries.end();
+             it != end; ++it) {
+            int index = rhs->collisionIndexOf(it->key);
+            if ((index < 0) ||
+                !mal::isEqual(it->value, rhs->m_entries[index].value)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Equal maps have the same shape, so any difference means a mismatch.
+    if (lhs->m_bitmap != rhs->m_bitmap) {
+        return false;
+    }
+    for (int i = 0, count = lhs->m_entries.size(); i < count; i++) {
+        const Entry& l = lhs->m_entries[i];
+        const Entry& r = rhs->m_entries[i];
+        if (l.child || r.child) {
+            if (!l.child || !r.child ||
+                !isEqual(l.child.ptr(), r.child.ptr(), shift + Bits)) {
+                return false;
+            }
+        }
+        else if (!isSameKey(l, r.key) || !mal::isEqual(l.value, r.value)) {
             return false;
         }
     }
     return true;
 }
 
-malLambda::malLambda(const StringVec& bindings,
-                     malValuePtr body, malEnvPtr env)
-: m_bindings(bindings)
-, m_body(body)
-, m_env(env)
+void malHashNode::visitRefs(RefVisitor& visitor)
+{
+    for (auto it = m_entries.begin(), end = m_entries.end(); it != end; ++it) {
+        visitor(it->key);
+        visitor(it->value);
+        visitor(it->child);
+    }
+}
+
+malLambda::malLambda(const malSymbolVec& bindings,
+                     malValuePtr body, malEnvPtr env, malCodePtr code)
+: malApplicable(LAMBDA)
+, m_bindings(bindings)
+, m_body(std::move(body))
+, m_env(std::move(env))
+, m_code(std::move(code))
 , m_isMacro(false)
 {
 
 }
 
 malLambda::malLambda(const malLambda& that, malValuePtr meta)
-: malApplicable(meta)
+: malApplicable(LAMBDA, meta)
 , m_bindings(that.m_bindings)
 , m_body(that.m_body)
 , m_env(that.m_env)
+, m_code(that.m_code)
 , m_isMacro(that.m_isMacro)
 {
 
 }
 
 malLambda::malLambda(const malLambda& that, bool isMacro)
-: malApplicable(that.m_meta)
+: malApplicable(LAMBDA, that.m_meta)
 , m_bindings(that.m_bindings)
 , m_body(that.m_body)
 , m_env(that.m_env)
+, m_code(that.m_code)
 , m_isMacro(isMacro)
 {
 
@@ -303,9 +544,34 @@ malLambda::malLambda(const malLambda& that, bool isMacro)
 malValuePtr malLambda::apply(malValueIter argsBegin,
                              malValueIter argsEnd) const
 {
+    if (m_code) {
+        // The code is held while it runs, as it may redefine this lambda.
+        malCodePtr code = m_code;
+        return code->run(makeEnv(argsBegin, argsEnd));
+    }
     return EVAL(m_body, makeEnv(argsBegin, argsEnd));
 }
 
+malValuePtr malCode::run(malEnvPtr env) const
+{
+    EvalStack::Level level;
+    Collector::safePoint();
+    malTailCall tail;
+    malCodePtr current;
+    const malCode* code = this;
+    while (1) {
+        malValuePtr result = code->exec(env, tail);
+        if (!tail.code) {
+            return result;
+        }
+        // Hold on to the tail call's code while it runs, since the lambda
+        // it came from may already have gone.
+        current = std::move(tail.code);
+        env = std::move(tail.env);
+        code = current.ptr();
+    }
+}
+
 malValuePtr malLambda::doWithMeta(malValuePtr meta) const
 {
     return new malLambda(*this, meta);
@@ -316,20 +582,37 @@ malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd) const
     return malEnvPtr(new malEnv(m_env, m_bindings, argsBegin, argsEnd));
 }
 
+void malLambda::visitRefs(RefVisitor& visitor)
+{
+    // The body is only ever code, so cycles pass through the environment.
+    malValue::visitRefs(visitor);
+    visitor(m_env);
+}
+
 malValuePtr malList::conj(malValueIter argsBegin,
                           malValueIter argsEnd) const
 {
-    int oldItemCount = std::distance(begin(), end());
-    int newItemCount = std::distance(argsBegin, argsEnd);
+    malList* list = prepend(std::distance(argsBegin, argsEnd));
+    std::reverse_copy(argsBegin, argsEnd, list->m_items);
+    return list;
+}
 
-    malValueVec* items = new malValueVec(oldItemCount + newItemCount);
-    std::reverse_copy(argsBegin, argsEnd, items->begin());
-    std::copy(begin(), end(), items->begin() + newItemCount);
+malValuePtr malConstant::eval(const malEnvPtr& env)
+{
+    return m_isSingleton ? malValuePtr::unmanaged(this) : malValuePtr(this);
+}
 
-    return mal::list(items);
+malValuePtr malInteger::eval(const malEnvPtr& env)
+{
+    // Without metadata this may be a temporary standing in for an immediate
+    // integer, so it mustn't hand out a pointer to itself.
+    if (!m_meta && malValuePtr::isImmediate(m_value)) {
+        return malValuePtr::integer(m_value);
+    }
+    return malValuePtr(this);
 }
 
-malValuePtr malList::eval(malEnvPtr env)
+malValuePtr malList::eval(const malEnvPtr& env)
 {
     // Note, this isn't actually called since the TCO updates, but
     // is required for the earlier steps, so don't get rid of it.
@@ -348,18 +631,35 @@ String malList::print(bool readably) const
     return '(' + malSequence::print(readably) + ')';
 }
 
-malValuePtr malValue::eval(malEnvPtr env)
+malValuePtr malValue::eval(const malEnvPtr& env)
 {
     // Default case of eval is just to return the object itself.
     return malValuePtr(this);
 }
 
+bool mal::isEqual(const malValuePtr& lhs, const malValuePtr& rhs)
+{
+    if (lhs == rhs) {
+        return true;
+    }
+    if (lhs.isInteger() || rhs.isInteger()) {
+        // One side is immediate, but the other may be a boxed integer.
+        const malValuePtr& other = lhs.isInteger() ? rhs : lhs;
+        return (other.isInteger() || DYNAMIC_CAST(malInteger, other))
+            && (integer_cast(lhs) == integer_cast(rhs));
+    }
+    return lhs->isEqualTo(rhs.ptr());
+}
+
 bool malValue::isEqualTo(const malValue* rhs) const
 {
+    if (this == rhs) {
+        return true;
+    }
+
     // Special-case. Vectors and Lists can be compared.
-    bool matchingTypes = (typeid(*this) == typeid(*rhs)) ||
-        (dynamic_cast<const malSequence*>(this) &&
-         dynamic_cast<const malSequence*>(rhs));
+    bool matchingTypes = (m_kind == rhs->m_kind) ||
+        (malSequence::isKind(m_kind) && malSequence::isKind(rhs->m_kind));
 
     return matchingTypes && doIsEqualTo(rhs);
 }
@@ -372,7 +672,7 @@ bool malValue::isTrue() const
 
 malValuePtr malValue::meta() const
 {
-    return m_meta.ptr() == NULL ? mal::nilValue() : m_meta;
+    return m_meta ? m_meta : mal::nilValue();
 }
 
 malValuePtr malValue::withMeta(malValuePtr meta) const
@@ -380,83 +680,231 @@ malValuePtr malValue::withMeta(malValuePtr meta) const
     return doWithMeta(meta);
 }
 
-malSequence::malSequence(malValueVec* items)
-: m_items(items)
+void malValue::visitRefs(RefVisitor& visitor)
+{
+    visitor(m_meta);
+}
+
+bool malSequence::doIsEqualTo(const malValue* rhs) const
 {
+    const malSequence* rhsSeq = static_cast<const malSequence*>(rhs);
+    int count = this->count();
+    if (count != rhsSeq->count()) {
+        return false;
+    }
 
+    for (int i = 0; i < count; i++) {
+        if (!mal::isEqual(item(i), rhsSeq->item(i))) {
+            return false;
+        }
+    }
+    return true;
 }
 
-malSequence::malSequence(malValueIter begin, malValueIter end)
-: m_items(new malValueVec(begin, end))
+malValueVec* malSequence::evalItems(const malEnvPtr& env) const
 {
+    int count = this->count();
+    malValueVec* items = new malValueVec;;
+    items->reserve(count);
+    for (int i = 0; i < count; i++) {
+        items->push_back(EVAL(item(i), env));
+    }
+    return items;
+}
 
+malValuePtr malSequence::cons(malValuePtr first) const
+{
+    int count = this->count();
+    malValueVec* items = new malValueVec(count + 1);
+    items->at(0) = first;
+    for (int i = 0; i < count; i++) {
+        items->at(i + 1) = item(i);
+    }
+    return mal::list(items);
 }
 
-malSequence::malSequence(const malSequence& that, malValuePtr meta)
-: malValue(meta)
-, m_items(new malValueVec(*(that.m_items)))
+malValuePtr malSequence::first() const
 {
+    return count() == 0 ? mal::nilValue() : item(0);
+}
 
+String malSequence::print(bool readably) const
+{
+    String str;
+    int count = this->count();
+    for (int i = 0; i < count; i++) {
+        if (i > 0) {
+            str += " ";
+        }
+        str += item(i)->print(readably);
+    }
+    return str;
 }
 
-malSequence::~malSequence()
+malValuePtr malSequence::rest() const
 {
-    delete m_items;
+    int count = this->count();
+    malValueVec* items = new malValueVec(count > 0 ? count - 1 : 0);
+    for (int i = 1; i < count; i++) {
+        items->at(i - 1) = item(i);
+    }
+    return mal::list(items);
 }
 
-bool malSequence::doIsEqualTo(const malValue* rhs) const
+malList::malList(malValueVec* items)
+: malSequence(LIST)
+, m_count(items->size())
 {
-    const malSequence* rhsSeq = static_cast<const malSequence*>(rhs);
-    if (count() != rhsSeq->count()) {
-        return false;
+    if (m_count <= InlineItems) {
+        std::copy(items->begin(), items->end(), m_inline);
+        m_items = m_inline;
     }
+    else {
+        m_store = new malValueStore(items);
+        m_items = &m_store->at(0);
+    }
+    delete items;
+}
 
-    for (malValueIter it0 = m_items->begin(),
-                      it1 = rhsSeq->begin(),
-                      end = m_items->end(); it0 != end; ++it0, ++it1) {
+malList::malList(malValueIter begin, malValueIter end)
+: malSequence(LIST)
+, m_count(std::distance(begin, end))
+{
+    if (m_count <= InlineItems) {
+        std::copy(begin, end, m_inline);
+        m_items = m_inline;
+    }
+    else {
+        m_store = new malValueStore(0, begin, end);
+        m_items = &m_store->at(0);
+    }
+}
 
-        if (! (*it0)->isEqualTo((*it1).ptr())) {
-            return false;
+malList::malList(malValueStorePtr store, int start)
+: malSequence(LIST)
+, m_items(&store->at(0) + start)
+, m_count(store->size() - start)
+, m_store(store)
+{
+
+}
+
+malList::malList(const malList& that, malValuePtr meta)
+: malSequence(LIST, meta)
+, m_items(that.m_store ? that.m_items : m_inline)
+, m_count(that.m_count)
+, m_store(that.m_store)
+{
+    if (!m_store) {
+        std::copy(that.m_items, that.m_items + m_count, m_inline);
+    }
+}
+
+// An inline list of count items, after spare empty slots.
+malList::malList(const malValuePtr* items, int count, int spare)
+: malSequence(LIST)
+, m_items(m_inline)
+, m_count(spare + count)
+{
+    std::copy(items, items + count, m_inline + spare);
+}
+
+malValuePtr malList::applyArgs(const malApplicable* op) const
+{
+    // apply takes iterators, so the arguments go on the ArgStack.
+    ArgStack::Frame args;
+    for (int i = 1; i < m_count; i++) {
+        args.push(m_items[i]);
+    }
+    return op->apply(args.begin(), args.end());
+}
+
+malCallSite& malList::callSite() const
+{
+    if (!m_callSite) {
+        m_callSite.reset(new malCallSite);
+    }
+    return *m_callSite;
+}
+
+malValuePtr malList::cons(malValuePtr first) const
+{
+    malList* list = prepend(1);
+    list->m_items[0] = first;
+    return list;
+}
+
+// Returns a list of these items after count empty slots, which the caller
+// fills in. The slots are in the shared store if nobody else has claimed
+// them, or else in a copy.
+malList* malList::prepend(int count) const
+{
+    if (m_store) {
+        int start = m_items - &m_store->at(0);
+        if (m_store->claim(start, count)) {
+            return new malList(m_store, start - count);
         }
     }
-    return true;
+    if (m_count + count <= InlineItems) {
+        return new malList(m_items, m_count, count);
+    }
+
+    // Leave as much room again, so that repeated conses are amortised O(1).
+    int spare = count + m_count;
+    malValueStorePtr store(
+        new malValueStore(spare, m_items, m_items + m_count));
+    store->claim(spare, count);
+    return new malList(store, spare - count);
 }
 
-malValueVec* malSequence::evalItems(malEnvPtr env) const
+malValuePtr malList::rest() const
 {
-    malValueVec* items = new malValueVec;;
-    items->reserve(count());
-    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
-        items->push_back(EVAL(*it, env));
+    int skip = isEmpty() ? 0 : 1;
+    if (m_store) {
+        return new malList(m_store, m_items + skip - &m_store->at(0));
     }
-    return items;
+    return new malList(m_items + skip, m_count - skip, 0);
 }
 
-malValuePtr malSequence::first() const
+void malList::visitRefs(RefVisitor& visitor)
 {
-    return count() == 0 ? mal::nilValue() : item(0);
+    malSequence::visitRefs(visitor);
+    visitor(m_store);
+    for (int i = 0; i < InlineItems; i++) {
+        visitor(m_inline[i]);
+    }
 }
 
-String malSequence::print(bool readably) const
+malValueStore::malValueStore(malValueVec* items)
+: m_front(0)
 {
-    String str;
-    auto end = m_items->cend();
-    auto it = m_items->cbegin();
-    if (it != end) {
-        str += (*it)->print(readably);
-        ++it;
+    m_items.swap(*items);
+}
+
+bool malValueStore::claim(int start, int count)
+{
+    // Only the sequence which starts at the front can grow into the spare
+    // room, and only once.
+    if ((start != m_front) || (start < count)) {
+        return false;
     }
-    for ( ; it != end; ++it) {
-        str += " ";
-        str += (*it)->print(readably);
+    m_front -= count;
+    return true;
+}
+
+void malValueStore::visitRefs(RefVisitor& visitor)
+{
+    for (auto it = m_items.begin(), end = m_items.end(); it != end; ++it) {
+        visitor(*it);
     }
-    return str;
 }
 
-malValuePtr malSequence::rest() const
+uint32_t malStringBase::computeHash() const
 {
-    malValueIter start = (count() > 0) ? begin() + 1 : end();
-    return mal::list(start, end());
+    // Mix in the kind, so that "a" and :a don't always collide.
+    uint64_t hash = std::hash<String>()(m_value) ^ (kind() * 0x9e3779b97f4a7c15);
+    uint32_t folded = static_cast<uint32_t>(hash ^ (hash >> 32));
+    return folded ? folded : 1; // zero means not computed yet
 }
 
 String malString::escapedValue() const
@@ -469,25 +917,160 @@ String malString::print(bool readably) const
     return readably ? escapedValue() : value();
 }
 
-malValuePtr malSymbol::eval(malEnvPtr env)
+malValuePtr malSymbol::eval(const malEnvPtr& env)
+{
+    return env->get(this);
+}
+
+malVector::malVector(malValueVec* items)
+: malSequence(VECTOR)
+, m_count(0)
+, m_shift(Bits)
 {
-    return env->get(value());
+    for (auto it = items->begin(), end = items->end(); it != end; ++it) {
+        push(*it);
+    }
+    delete items;
+}
+
+malVector::malVector(malValueIter begin, malValueIter end)
+: malSequence(VECTOR)
+, m_count(0)
+, m_shift(Bits)
+{
+    for (auto it = begin; it != end; ++it) {
+        push(*it);
+    }
+}
+
+malVector::malVector(const malVector& that, malValuePtr meta)
+: malSequence(VECTOR, meta)
+, m_count(that.m_count)
+, m_shift(that.m_shift)
+, m_root(that.m_root)
+, m_tail(that.m_tail)
+{
+    if (!m_tail) {
+        std::copy(that.m_inline, that.m_inline + m_count, m_inline);
+    }
+}
+
+malValuePtr malVector::assoc(int index, malValuePtr value) const
+{
+    malVector* vec = new malVector(*this, malValuePtr());
+    if (index == m_count) {
+        vec->push(value);
+        return vec;
+    }
+    if (!m_tail) {
+        vec->m_inline[index] = value;
+        return vec;
+    }
+    if (index >= tailOffset()) {
+        vec->m_tail = new malVectorLeaf(m_tail.ptr(), m_count - tailOffset());
+        vec->m_tail->at(index & Mask) = value;
+        return vec;
+    }
+
+    // Copy the path down to the leaf, and share everything else.
+    vec->m_root = new malVectorBranch(m_root.ptr());
+    malVectorBranch* branch = vec->m_root.ptr();
+    for (int level = m_shift; level > Bits; level -= Bits) {
+        RefCountedPtr<RefCounted>& child = branch->at((index >> level) & Mask);
+        malVectorBranch* copy = new malVectorBranch(
+            static_cast<malVectorBranch*>(child.ptr()));
+        child = copy;
+        branch = copy;
+    }
+    RefCountedPtr<RefCounted>& child = branch->at((index >> Bits) & Mask);
+    malVectorLeaf* leaf =
+        new malVectorLeaf(static_cast<malVectorLeaf*>(child.ptr()), Width);
+    child = leaf;
+    leaf->at(index & Mask) = value;
+    return vec;
 }
 
 malValuePtr malVector::conj(malValueIter argsBegin,
                             malValueIter argsEnd) const
 {
-    int oldItemCount = std::distance(begin(), end());
-    int newItemCount = std::distance(argsBegin, argsEnd);
+    malVector* vec = new malVector(*this, malValuePtr());
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        vec->push(*it);
+    }
+    return vec;
+}
+
+const malValuePtr* malVector::leafFor(int index) const
+{
+    if (index >= tailOffset()) {
+        return m_tail->values();
+    }
+    RefCounted* node = m_root.ptr();
+    for (int level = m_shift; level > 0; level -= Bits) {
+        node = static_cast<malVectorBranch*>(node)->at((index >> level) & Mask)
+                                                   .ptr();
+    }
+    return static_cast<malVectorLeaf*>(node)->values();
+}
 
-    malValueVec* items = new malValueVec(oldItemCount + newItemCount);
-    std::copy(begin(), end(), items->begin());
-    std::copy(argsBegin, argsEnd, items->begin() + oldItemCount);
+void malVector::push(malValuePtr value)
+{
+    if (!m_tail) {
+        if (m_count < InlineItems) {
+            m_inline[m_count++] = value;
+            return;
+        }
+        // Outgrown, so the items move to the tail leaf.
+        m_tail = new malVectorLeaf;
+        for (int i = 0; i < m_count; i++) {
+            m_tail->claim(i);
+            m_tail->at(i) = m_inline[i];
+            m_inline[i] = malValuePtr();
+        }
+    }
 
-    return mal::vector(items);
+    int tailCount = m_count - tailOffset();
+    if (tailCount == Width) {
+        // The tail is full, so it moves into the trie. If the root is full
+        // too, the trie grows a level.
+        int index = m_count - 1;
+        if (m_root && ((m_count >> Bits) > (1 << m_shift))) {
+            malVectorBranchPtr root(new malVectorBranch);
+            root->at(0) = m_root.ptr();
+            m_root = root;
+            m_shift += Bits;
+        }
+        else if (m_root) {
+            m_root = new malVectorBranch(m_root.ptr());
+        }
+        else {
+            m_root = new malVectorBranch;
+        }
+        malVectorBranch* branch = m_root.ptr();
+        for (int level = m_shift; level > Bits; level -= Bits) {
+            RefCountedPtr<RefCounted>& child =
+                branch->at((index >> level) & Mask);
+            malVectorBranch* copy = child
+                ? new malVectorBranch(static_cast<malVectorBranch*>(child.ptr()))
+                : new malVectorBranch;
+            child = copy;
+            branch = copy;
+        }
+        branch->at((index >> Bits) & Mask) = m_tail.ptr();
+        m_tail = malVectorLeafPtr();
+        tailCount = 0;
+    }
+
+    if (!m_tail || !m_tail->claim(tailCount)) {
+        m_tail = m_tail ? new malVectorLeaf(m_tail.ptr(), tailCount)
+                        : new malVectorLeaf;
+        m_tail->claim(tailCount);
+    }
+    m_tail->at(tailCount) = value;
+    m_count++;
 }
 
-malValuePtr malVector::eval(malEnvPtr env)
+malValuePtr malVector::eval(const malEnvPtr& env)
 {
     return mal::vector(evalItems(env));
 }
@@ -496,3 +1079,55 @@ String malVector::print(bool readably) const
 {
     return '[' + malSequence::print(readably) + ']';
 }
+
+void malVector::visitRefs(RefVisitor& visitor)
+{
+    malSequence::visitRefs(visitor);
+    visitor(m_root);
+    visitor(m_tail);
+    for (int i = 0; i < InlineItems; i++) {
+        visitor(m_inline[i]);
+    }
+}
+
+malVectorBranch::malVectorBranch(const malVectorBranch* that)
+{
+    std::copy(that->m_children, that->m_children + 32, m_children);
+}
+
+void malVectorBranch::visitRefs(RefVisitor& visitor)
+{
+    for (int i = 0; i < 32; i++) {
+        visitor(m_children[i]);
+    }
+}
+
+malVectorLeaf::malVectorLeaf(const malVectorLeaf* that, int count)
+: m_used(count)
+{
+    std::copy(that->m_values, that->m_values + count, m_values);
+}
+
+bool malVectorLeaf::claim(int index)
+{
+    // As with malValueStore, only the first vector to reach the end of the
+    // used slots may extend it.
+    if ((index != m_used) || (index >= 32)) {
+        return false;
+    }
+    m_used++;
+    return true;
+}
+
+void malVectorLeaf::visitRefs(RefVisitor& visitor)
+{
+    for (int i = 0; i < m_used; i++) {
+        visitor(m_values[i]);
+    }
+}
+
+void malAtom::visitRefs(RefVisitor& visitor)
+{
+    malValue::visitRefs(visitor);
+    visitor(m_value);
+}
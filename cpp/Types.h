@@ -3,23 +3,45 @@
 
 #include "MAL.h"
 
+#include <algorithm>
 #include <exception>
-#include <map>
+#include <iterator>
+#include <memory>
+#include <new>
 
 class malEmptyInputException : public std::exception { };
 
 class malValue : public RefCounted {
 public:
-    malValue() {
+    // Every concrete type has its own kind, and each abstract type covers a
+    // contiguous range of them, so type checks don't need RTTI.
+    enum Kind {
+        CONSTANT,
+        INTEGER,
+        STRING,     // malStringBase...
+        KEYWORD,
+        SYMBOL,     // ...malStringBase
+        LIST,       // malSequence...
+        VECTOR,     // ...malSequence
+        HASH,
+        ATOM,
+        BUILTIN,    // malApplicable...
+        LAMBDA,     // ...malApplicable
+    };
+
+    malValue(Kind kind) : m_kind(kind) {
         TRACE_OBJECT("Creating malValue %p\n", this);
     }
-    malValue(malValuePtr meta) : m_meta(meta) {
+    malValue(Kind kind, malValuePtr meta) : m_kind(kind), m_meta(meta) {
         TRACE_OBJECT("Creating malValue %p\n", this);
     }
     virtual ~malValue() {
         TRACE_OBJECT("Destroying malValue %p\n", this);
     }
 
+    Kind kind() const { return m_kind; }
+    static bool isKind(Kind kind) { return true; }
+
     malValuePtr withMeta(malValuePtr meta) const;
     virtual malValuePtr doWithMeta(malValuePtr meta) const = 0;
     malValuePtr meta() const;
@@ -28,26 +50,28 @@ public:
 
     bool isEqualTo(const malValue* rhs) const;
 
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr eval(const malEnvPtr& env);
 
     virtual String print(bool readably) const = 0;
 
+    virtual void visitRefs(RefVisitor& visitor);
+
 protected:
     virtual bool doIsEqualTo(const malValue* rhs) const = 0;
 
+    const Kind  m_kind;
     malValuePtr m_meta;
 };
 
 template<class T>
-T* value_cast(malValuePtr obj, const char* typeName) {
-    T* dest = dynamic_cast<T*>(obj.ptr());
-    MAL_CHECK(dest != NULL, "%s is not a %s",
-              obj->print(true).c_str(), typeName);
-    return dest;
+T* kind_cast(malValue* obj) {
+    return (obj != NULL) && T::isKind(obj->kind()) ? static_cast<T*>(obj)
+                                                     : NULL;
 }
 
 #define VALUE_CAST(Type, Value)    value_cast<Type>(Value, #Type)
-#define DYNAMIC_CAST(Type, Value)  (dynamic_cast<Type*>((Value).ptr()))
+#define INTEGER_CAST(Value)        integer_cast(Value)
+#define DYNAMIC_CAST(Type, Value)  (kind_cast<Type>((Value).ptr()))
 #define STATIC_CAST(Type, Value)   (static_cast<Type*>((Value).ptr()))
 
 #define WITH_META(Type) \
@@ -57,9 +81,18 @@ T* value_cast(malValuePtr obj, const char* typeName) {
 
 class malConstant : public malValue {
 public:
-    malConstant(String name) : m_name(name) { }
+    // Used for the nil, true and false singletons, which are never freed.
+    malConstant(String name)
+        : malValue(CONSTANT), m_name(name), m_isSingleton(true) {
+        acquire();
+    }
     malConstant(const malConstant& that, malValuePtr meta)
-        : malValue(meta), m_name(that.m_name) { }
+        : malValue(CONSTANT, meta), m_name(that.m_name), m_isSingleton(false)
+    { }
+
+    static bool isKind(Kind kind) { return kind == CONSTANT; }
+
+    virtual malValuePtr eval(const malEnvPtr& env);
 
     virtual String print(bool readably) const { return m_name; }
 
@@ -71,13 +104,18 @@ public:
 
 private:
     const String m_name;
+    const bool   m_isSingleton;
 };
 
 class malInteger : public malValue {
 public:
-    malInteger(int64_t value) : m_value(value) { }
+    malInteger(int64_t value) : malValue(INTEGER), m_value(value) { }
     malInteger(const malInteger& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : malValue(INTEGER, meta), m_value(that.m_value) { }
+
+    static bool isKind(Kind kind) { return kind == INTEGER; }
+
+    virtual malValuePtr eval(const malEnvPtr& env);
 
     virtual String print(bool readably) const {
         return std::to_string(m_value);
@@ -95,28 +133,158 @@ private:
     const int64_t m_value;
 };
 
+// The malValuePtr inlines need the full malValue and malInteger definitions.
+
+class malValuePtr::Arrow {
+public:
+    Arrow(malValue* object) : m_object(object) { }
+    Arrow(int64_t value) : m_object(::new (m_storage) malInteger(value)) { }
+    Arrow(const Arrow& that) : m_object(that.m_object) {
+        if (that.isTemporary()) {
+            m_object = ::new (m_storage) malInteger(
+                static_cast<malInteger*>(that.m_object)->value());
+        }
+    }
+    ~Arrow() {
+        if (isTemporary()) {
+            static_cast<malInteger*>(m_object)->~malInteger();
+        }
+    }
+
+    malValue* operator -> () const { return m_object; }
+
+private:
+    Arrow& operator = (const Arrow&); // no assignments
+
+    bool isTemporary() const {
+        return m_object == reinterpret_cast<const malValue*>(m_storage);
+    }
+
+    alignas(malInteger) char m_storage[sizeof(malInteger)];
+    malValue* m_object;
+};
+
+inline malValuePtr::malValuePtr(malValue* object)
+: m_bits(reinterpret_cast<uintptr_t>(object))
+{
+    acquire();
+}
+
+inline malValuePtr::malValuePtr(const malValuePtr& rhs)
+: m_bits(rhs.m_bits)
+{
+    acquire();
+}
+
+inline malValuePtr::~malValuePtr()
+{
+    release();
+}
+
+inline const malValuePtr& malValuePtr::operator = (const malValuePtr& rhs)
+{
+    // rhs may live inside the value being released, so read it first.
+    uintptr_t bits = rhs.m_bits;
+    rhs.acquire();
+    release();
+    m_bits = bits;
+    return *this;
+}
+
+inline const malValuePtr& malValuePtr::operator = (malValuePtr&& rhs) noexcept
+{
+    uintptr_t bits = rhs.m_bits;
+    rhs.m_bits = 0;
+    release();
+    m_bits = bits;
+    return *this;
+}
+
+inline malValuePtr malValuePtr::integer(int64_t value)
+{
+    return malValuePtr((static_cast<uintptr_t>(value) << TagBits) | IntegerTag,
+                       true);
+}
+
+inline malValuePtr malValuePtr::unmanaged(malValue* object)
+{
+    return malValuePtr(reinterpret_cast<uintptr_t>(object) | UnmanagedTag,
+                       true);
+}
+
+inline malValuePtr::Arrow malValuePtr::operator -> () const
+{
+    return isInteger() ? Arrow(integerValue()) : Arrow(ptr());
+}
+
+inline void malValuePtr::acquire() const
+{
+    if (isManaged()) {
+        ptr()->acquire();
+    }
+}
+
+inline void malValuePtr::release() const
+{
+    if (isManaged()) {
+        ptr()->release();
+    }
+}
+
+template<class T>
+T* value_cast(malValuePtr obj, const char* typeName) {
+    T* dest = kind_cast<T>(obj.ptr());
+    MAL_CHECK(dest != NULL, "%s is not a %s",
+              obj->print(true).c_str(), typeName);
+    return dest;
+}
+
+// Integers are usually immediate, so they can't be cast to malInteger.
+inline int64_t integer_cast(const malValuePtr& obj)
+{
+    if (obj.isInteger()) {
+        return obj.integerValue();
+    }
+    return value_cast<malInteger>(obj, "malInteger")->value();
+}
+
 class malStringBase : public malValue {
 public:
-    malStringBase(const String& token)
-        : m_value(token) { }
+    malStringBase(Kind kind, const String& token)
+        : malValue(kind), m_value(token), m_hash(0) { }
     malStringBase(const malStringBase& that, malValuePtr meta)
-        : malValue(meta), m_value(that.value()) { }
+        : malValue(that.kind(), meta), m_value(that.value())
+        , m_hash(that.m_hash) { }
+
+    static bool isKind(Kind kind) {
+        return (kind >= STRING) && (kind <= SYMBOL);
+    }
 
     virtual String print(bool readably) const { return m_value; }
 
-    String value() const { return m_value; }
+    const String& value() const { return m_value; }
+
+    // Computed on first use, since most strings are never hash keys.
+    uint32_t hash() const {
+        return m_hash ? m_hash : (m_hash = computeHash());
+    }
 
 private:
-    const String m_value;
+    uint32_t computeHash() const;
+
+    const String     m_value;
+    mutable uint32_t m_hash;
 };
 
 class malString : public malStringBase {
 public:
     malString(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(STRING, token) { }
     malString(const malString& that, malValuePtr meta)
         : malStringBase(that, meta) { }
 
+    static bool isKind(Kind kind) { return kind == STRING; }
+
     virtual String print(bool readably) const;
 
     String escapedValue() const;
@@ -128,134 +296,400 @@ public:
     WITH_META(malString);
 };
 
+// Keywords and symbols are interned by mal::keyword() and mal::symbol(), so
+// there is only ever one object for each name, and they can be compared by
+// pointer. Copies made by with-meta keep a pointer to the interned object.
 class malKeyword : public malStringBase {
 public:
     malKeyword(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(KEYWORD, token), m_interned(this) { }
     malKeyword(const malKeyword& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+        : malStringBase(that, meta), m_interned(that.m_interned) { }
+
+    static bool isKind(Kind kind) { return kind == KEYWORD; }
+
+    const malKeyword* interned() const { return m_interned; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return value() == static_cast<const malKeyword*>(rhs)->value();
+        return m_interned == static_cast<const malKeyword*>(rhs)->m_interned;
     }
 
     WITH_META(malKeyword);
+
+private:
+    const malKeyword* const m_interned;
 };
 
 class malSymbol : public malStringBase {
 public:
     malSymbol(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(SYMBOL, token), m_interned(this), m_isLocal(false)
+        , m_specialForm(0) { }
     malSymbol(const malSymbol& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+        : malStringBase(that, meta), m_interned(that.m_interned)
+        , m_isLocal(false), m_specialForm(0) { }
+
+    static bool isKind(Kind kind) { return kind == SYMBOL; }
 
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr eval(const malEnvPtr& env);
+
+    const malSymbol* interned() const { return m_interned; }
+
+    // Whether the symbol has ever been bound outside the global environment.
+    // If not, a lookup can go straight to the global binding.
+    bool isLocal() const { return m_interned->m_isLocal; }
+    void markLocal() const { m_interned->m_isLocal = true; }
+
+    // Non-zero for the special forms, which each step numbers for itself.
+    int specialForm() const { return m_interned->m_specialForm; }
+    void setSpecialForm(int id) const { m_interned->m_specialForm = id; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return value() == static_cast<const malSymbol*>(rhs)->value();
+        return m_interned == static_cast<const malSymbol*>(rhs)->m_interned;
     }
 
     WITH_META(malSymbol);
+
+private:
+    const malSymbol* const m_interned;
+    mutable bool           m_isLocal;
+    mutable int            m_specialForm;
 };
 
+// Element storage which can be shared by several sequences. Each sequence
+// sees the elements from its own start index through to the end, so rest()
+// only has to move the start along. New elements are only ever added in the
+// spare room before the first element, and a slot is only claimed by the
+// first sequence to ask for it, so existing sequences never see a change.
+// Lists only use one of these once they're too long to hold their items
+// inline.
+class malValueStore : public RefCounted {
+public:
+    malValueStore(malValueVec* items);
+    template <class Iter>
+    malValueStore(int spare, Iter begin, Iter end)
+    : m_items(spare + std::distance(begin, end))
+    , m_front(spare)
+    {
+        std::copy(begin, end, m_items.begin() + spare);
+    }
+
+    malValuePtr& at(int index) { return m_items[index]; }
+    int size() const { return m_items.size(); }
+
+    bool claim(int start, int count);
+
+    virtual void visitRefs(RefVisitor& visitor);
+
+private:
+    malValueVec m_items;
+    int         m_front;
+};
+
+typedef RefCountedPtr<malValueStore> malValueStorePtr;
+
 class malSequence : public malValue {
 public:
-    malSequence(malValueVec* items);
-    malSequence(malValueIter begin, malValueIter end);
-    malSequence(const malSequence& that, malValuePtr meta);
-    virtual ~malSequence();
+    malSequence(Kind kind) : malValue(kind) { }
+    malSequence(Kind kind, malValuePtr meta) : malValue(kind, meta) { }
 
-    virtual String print(bool readably) const;
+    static bool isKind(Kind kind) {
+        return (kind >= LIST) && (kind <= VECTOR);
+    }
 
-    malValueVec* evalItems(malEnvPtr env) const;
-    int count() const { return m_items->size(); }
-    bool isEmpty() const { return m_items->empty(); }
-    malValuePtr item(int index) const { return (*m_items)[index]; }
+    virtual String print(bool readably) const;
 
-    malValueIter begin() const { return m_items->begin(); }
-    malValueIter end()   const { return m_items->end(); }
+    malValueVec* evalItems(const malEnvPtr& env) const;
+    virtual int count() const = 0;
+    bool isEmpty() const { return count() == 0; }
+    virtual const malValuePtr& item(int index) const = 0;
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
 
     virtual malValuePtr conj(malValueIter argsBegin,
                               malValueIter argsEnd) const = 0;
 
+    // Short sequences keep their items in the object itself, so that they
+    // take a single allocation.
+    enum { InlineItems = 4 };
+
     malValuePtr first() const;
     virtual malValuePtr rest() const;
 
-private:
-    malValueVec* const m_items;
+    // Returns a list of first followed by these items.
+    virtual malValuePtr cons(malValuePtr first) const;
+};
+
+class malApplicable;
+
+// A list which is evaluated as a call can cache what its head resolved to,
+// and what it expanded to if that was a macro. The owner of the cache
+// decides when each part is still valid.
+struct malCallSite {
+    malCallSite() : op(NULL), opVersion(0), headCell(NULL) { }
+
+    // The function the head evaluated to, while the global environment is
+    // at opVersion. Its global binding keeps it alive until then, so this
+    // doesn't hold a reference.
+    malApplicable* op;
+    unsigned       opVersion;
+
+    // The global binding of the head symbol.
+    malValuePtr*   headCell;
+
+    // The expansion made by the macro expandedBy.
+    malValuePtr    expandedBy;
+    malValuePtr    expansion;
+
+    // The cons/concat form which a quasiquote form rewrites to.
+    malValuePtr    quasiquoted;
 };
 
 class malList : public malSequence {
 public:
-    malList(malValueVec* items) : malSequence(items) { }
-    malList(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
-    malList(const malList& that, malValuePtr meta)
-        : malSequence(that, meta) { }
+    malList(malValueVec* items);
+    malList(malValueIter begin, malValueIter end);
+    malList(malValueStorePtr store, int start);
+    malList(const malList& that, malValuePtr meta);
+
+    static bool isKind(Kind kind) { return kind == LIST; }
 
     virtual String print(bool readably) const;
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr eval(const malEnvPtr& env);
+
+    virtual int count() const { return m_count; }
+    virtual const malValuePtr& item(int index) const {
+        return m_items[index];
+    }
 
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
 
+    virtual malValuePtr rest() const;
+
+    // Shares these items with the new list.
+    virtual malValuePtr cons(malValuePtr first) const;
+
+    // Applies op to the items after the first, as a call of this list would.
+    malValuePtr applyArgs(const malApplicable* op) const;
+
+    // What EVAL has learned about this list as a call site, created the
+    // first time it's asked for.
+    malCallSite& callSite() const;
+
+    virtual void visitRefs(RefVisitor& visitor);
+
     WITH_META(malList);
+
+private:
+    malList(const malValuePtr* items, int count, int spare);
+
+    malList* prepend(int count) const;
+
+    // The items are either in m_inline, or from m_items to the end of
+    // m_store.
+    malValuePtr*     m_items;
+    int              m_count;
+    malValueStorePtr m_store;
+    malValuePtr      m_inline[InlineItems];
+
+    mutable std::unique_ptr<malCallSite> m_callSite;
 };
 
+// A vector is a 32-way trie of leaves, plus a tail leaf which holds the last
+// 1 to 32 items. Nodes are never changed once they are visible to another
+// vector, so conj and assoc copy the path they change and share the rest.
+// The exception is that the first vector to append to a tail leaf can claim
+// the next slot in place, as malValueStore does for lists. A vector short
+// enough to hold its items inline has no leaves at all.
+class malVectorLeaf : public RefCounted {
+public:
+    malVectorLeaf() : m_used(0) { }
+    malVectorLeaf(const malVectorLeaf* that, int count);
+
+    malValuePtr& at(int index) { return m_values[index]; }
+    const malValuePtr* values() const { return m_values; }
+
+    bool claim(int index);
+
+    virtual void visitRefs(RefVisitor& visitor);
+
+private:
+    malValuePtr m_values[32];
+    int         m_used;
+};
+
+class malVectorBranch : public RefCounted {
+public:
+    malVectorBranch() { }
+    malVectorBranch(const malVectorBranch* that);
+
+    RefCountedPtr<RefCounted>& at(int index) { return m_children[index]; }
+
+    virtual void visitRefs(RefVisitor& visitor);
+
+private:
+    RefCountedPtr<RefCounted> m_children[32];
+};
+
+typedef RefCountedPtr<malVectorLeaf>   malVectorLeafPtr;
+typedef RefCountedPtr<malVectorBranch> malVectorBranchPtr;
+
 class malVector : public malSequence {
 public:
-    malVector(malValueVec* items) : malSequence(items) { }
-    malVector(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
-    malVector(const malVector& that, malValuePtr meta)
-        : malSequence(that, meta) { }
+    malVector(malValueVec* items);
+    malVector(malValueIter begin, malValueIter end);
+    malVector(const malVector& that, malValuePtr meta);
+
+    static bool isKind(Kind kind) { return kind == VECTOR; }
 
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr eval(const malEnvPtr& env);
     virtual String print(bool readably) const;
 
+    virtual int count() const { return m_count; }
+    virtual const malValuePtr& item(int index) const {
+        return m_tail ? leafFor(index)[index & Mask] : m_inline[index];
+    }
+
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
 
+    // Returns a copy with the item at index replaced, or appended if index
+    // is count().
+    malValuePtr assoc(int index, malValuePtr value) const;
+
+    virtual void visitRefs(RefVisitor& visitor);
+
     WITH_META(malVector);
+
+private:
+    enum { Bits = 5, Width = 1 << Bits, Mask = Width - 1 };
+
+    // Only used on vectors which nobody else can see yet.
+    void push(malValuePtr value);
+
+    int tailOffset() const {
+        return m_count < Width ? 0 : ((m_count - 1) >> Bits) << Bits;
+    }
+    const malValuePtr* leafFor(int index) const;
+
+    int                m_count;
+    int                m_shift;
+    malVectorBranchPtr m_root;
+    malVectorLeafPtr   m_tail;
+    malValuePtr        m_inline[InlineItems]; // only used without m_tail
 };
 
 class malApplicable : public malValue {
 public:
-    malApplicable() { }
-    malApplicable(malValuePtr meta) : malValue(meta) { }
+    malApplicable(Kind kind) : malValue(kind) { }
+    malApplicable(Kind kind, malValuePtr meta) : malValue(kind, meta) { }
+
+    static bool isKind(Kind kind) {
+        return (kind >= BUILTIN) && (kind <= LAMBDA);
+    }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                                malValueIter argsEnd) const = 0;
 };
 
-class malHash : public malValue {
+// A node in a malHash's hash array mapped trie. Each level uses the next 5
+// bits of the key's hash to pick one of 32 slots, and the bitmap says which
+// slots are in use, so only those take up room in m_entries. An entry holds
+// either a key and its value, or a child node for the keys which share that
+// part of the hash. Once the hash bits run out, a node is just a list of the
+// colliding keys.
+//
+// Nodes are never changed once they're shared, so updates copy the path to
+// the change. A child always holds at least two keys, which means the shape
+// of the trie depends only on its keys, and equal maps can be compared node
+// by node.
+class malHashNode : public RefCounted {
 public:
-    typedef std::map<String, malValuePtr> Map;
+    struct Entry {
+        malValuePtr                key; // a malString or malKeyword
+        malValuePtr                value;
+        RefCountedPtr<malHashNode> child;
+    };
+
+    malHashNode() : m_bitmap(0) { }
+    malHashNode(const malHashNode* that)
+        : m_bitmap(that->m_bitmap), m_entries(that->m_entries) { }
+
+    typedef RefCountedPtr<malHashNode> Ptr;
+
+    const malValuePtr* find(const malValuePtr& key, uint32_t hash,
+                            int shift) const;
+
+    // These return this node if nothing changed, and dissoc returns NULL if
+    // the node is left empty.
+    Ptr assoc(const malValuePtr& key, uint32_t hash, int shift,
+              malValuePtr value, bool& added) const;
+    Ptr dissoc(const malValuePtr& key, uint32_t hash, int shift) const;
+
+    static bool isEqual(const malHashNode* lhs, const malHashNode* rhs,
+                        int shift);
+
+    template<class Fn> void forEach(Fn fn) const {
+        for (auto it = m_entries.begin(), end = m_entries.end();
+             it != end; ++it) {
+            if (it->child) {
+                it->child->forEach(fn);
+            }
+            else {
+                fn(*it);
+            }
+        }
+    }
+
+    virtual void visitRefs(RefVisitor& visitor);
+
+private:
+    enum { Bits = 5, Mask = (1 << Bits) - 1, HashBits = 32 };
+
+    int indexOf(uint32_t bit) const {
+        return __builtin_popcount(m_bitmap & (bit - 1));
+    }
+    int collisionIndexOf(const malValuePtr& key) const;
 
+    uint32_t           m_bitmap;
+    std::vector<Entry> m_entries;
+};
+
+typedef malHashNode::Ptr malHashNodePtr;
+
+class malHash : public malValue {
+public:
     malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated);
-    malHash(const malHash::Map& map);
+    malHash(malHashNodePtr root, int count);
     malHash(const malHash& that, malValuePtr meta)
-    : malValue(meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated) { }
+    : malValue(HASH, meta), m_root(that.m_root), m_count(that.m_count)
+    , m_isEvaluated(that.m_isEvaluated) { }
+
+    static bool isKind(Kind kind) { return kind == HASH; }
 
     malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd) const;
     malValuePtr dissoc(malValueIter argsBegin, malValueIter argsEnd) const;
     bool contains(malValuePtr key) const;
-    malValuePtr eval(malEnvPtr env);
+    malValuePtr eval(const malEnvPtr& env);
     malValuePtr get(malValuePtr key) const;
     malValuePtr keys() const;
+    // False for a map literal, whose values are still forms to evaluate.
+    bool isEvaluated() const { return m_isEvaluated; }
     malValuePtr values() const;
 
     virtual String print(bool readably) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
 
+    virtual void visitRefs(RefVisitor& visitor);
+
     WITH_META(malHash);
 
 private:
-    const Map m_map;
-    const bool m_isEvaluated;
+    malHashNodePtr m_root;
+    int            m_count;
+    const bool     m_isEvaluated;
 };
 
 class malBuiltIn : public malApplicable {
@@ -265,10 +699,13 @@ public:
                                     malValueIter argsEnd);
 
     malBuiltIn(const String& name, ApplyFunc* handler)
-    : m_name(name), m_handler(handler) { }
+    : malApplicable(BUILTIN), m_name(name), m_handler(handler) { }
 
     malBuiltIn(const malBuiltIn& that, malValuePtr meta)
-    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler) { }
+    : malApplicable(BUILTIN, meta), m_name(that.m_name)
+    , m_handler(that.m_handler) { }
+
+    static bool isKind(Kind kind) { return kind == BUILTIN; }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
@@ -290,16 +727,42 @@ private:
     ApplyFunc* m_handler;
 };
 
+class malCode;
+typedef RefCountedPtr<malCode> malCodePtr;
+
+// A call in tail position hands back the code and environment to run next,
+// rather than running it, so that the stack doesn't grow.
+struct malTailCall {
+    malCodePtr code;
+    malEnvPtr  env;
+};
+
+// A lambda body which has been compiled by Compiler.cpp, and so can be run
+// without walking the AST.
+class malCode : public RefCounted {
+public:
+    // Evaluates this code in env. Code in tail position may instead fill in
+    // tail and return NULL.
+    virtual malValuePtr exec(const malEnvPtr& env, malTailCall& tail) const = 0;
+
+    // Runs this code, and any tail calls it makes, to completion.
+    malValuePtr run(malEnvPtr env) const;
+};
+
 class malLambda : public malApplicable {
 public:
-    malLambda(const StringVec& bindings, malValuePtr body, malEnvPtr env);
+    malLambda(const malSymbolVec& bindings, malValuePtr body, malEnvPtr env,
+              malCodePtr code = NULL);
     malLambda(const malLambda& that, malValuePtr meta);
     malLambda(const malLambda& that, bool isMacro);
 
+    static bool isKind(Kind kind) { return kind == LAMBDA; }
+
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
 
     malValuePtr getBody() const { return m_body; }
+    const malCodePtr& getCode() const { return m_code; }
     malEnvPtr makeEnv(malValueIter argsBegin, malValueIter argsEnd) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
@@ -314,18 +777,27 @@ public:
 
     virtual malValuePtr doWithMeta(malValuePtr meta) const;
 
+    virtual void visitRefs(RefVisitor& visitor);
+
 private:
-    const StringVec   m_bindings;
+    const malSymbolVec m_bindings;
     const malValuePtr m_body;
-    const malEnvPtr   m_env;
+    malEnvPtr         m_env;
+    const malCodePtr  m_code;
     const bool        m_isMacro;
 };
 
 class malAtom : public malValue {
 public:
-    malAtom(malValuePtr value) : m_value(value) { }
+    malAtom(malValuePtr value) : malValue(ATOM), m_value(value) {
+        mayCloseCycles();
+    }
     malAtom(const malAtom& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : malValue(ATOM, meta), m_value(that.m_value) {
+        mayCloseCycles();
+    }
+
+    static bool isKind(Kind kind) { return kind == ATOM; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this->m_value->isEqualTo(rhs);
@@ -339,6 +811,8 @@ public:
 
     malValuePtr reset(malValuePtr value) { return m_value = value; }
 
+    virtual void visitRefs(RefVisitor& visitor);
+
     WITH_META(malAtom);
 
 private:
@@ -352,11 +826,13 @@ namespace mal {
     malValuePtr falseValue();
     malValuePtr hash(malValueIter argsBegin, malValueIter argsEnd,
                      bool isEvaluated);
-    malValuePtr hash(const malHash::Map& map);
+    malValuePtr hash(malHashNodePtr root, int count);
     malValuePtr integer(int64_t value);
     malValuePtr integer(const String& token);
+    bool isEqual(const malValuePtr& lhs, const malValuePtr& rhs);
     malValuePtr keyword(const String& token);
-    malValuePtr lambda(const StringVec&, malValuePtr, malEnvPtr);
+    malValuePtr lambda(const malSymbolVec&, malValuePtr, malEnvPtr,
+                       malCodePtr code = NULL);
     malValuePtr list(malValueVec* items);
     malValuePtr list(malValueIter begin, malValueIter end);
     malValuePtr list(malValuePtr a);
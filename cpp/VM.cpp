@@ -0,0 +1,894 @@
+#include "ArgStack.h"
+#include "Compiler.h"
+#include "Environment.h"
+
+#include <utility>
+
+// The VM runs the body of a fn* from a flat array of instructions. Its
+// parameters and let* bindings live in registers rather than in malEnv
+// frames, and a few builtins from Core.cpp are opcodes of their own, so
+// most calls to them never leave the dispatch loop.
+//
+// Only bodies which can't capture their registers are compiled: no fn*,
+// def!, try* or macroexpand, and no map literals. Anything else is left to
+// the closure compiler.
+
+namespace {
+
+enum OpCode {
+    OpConst,        // k            push constant k
+    OpLocal,        // r            push register r
+    OpOuter,        // i            push the enclosing local described by i
+    OpGlobal,       // g            push global g
+    OpStore,        // r            pop into register r
+    OpPop,          //              drop the top of the stack
+    OpJump,         // t            continue at t
+    OpJumpIfFalse,  // t            pop, and continue at t if it's false
+    OpCall,         // n site       call the function below n arguments
+    OpTailCall,     // n site       ... and hand it back to run
+    OpReturn,       //              return the top of the stack
+    OpVector,       // n            make a vector of the top n values
+
+    // Builtins, which are checked to still be bound to the global g.
+    OpAdd,          // g site
+    OpSub,          // g site
+    OpLessEqual,    // g site
+    OpEqual,        // g site
+    OpFirst,        // g site
+    OpRest,         // g site
+    OpCount,        // g site
+    OpEmpty,        // g site
+
+    // Superinstructions for (op register constant), as in (+ a 1), and for
+    // (if (op register constant) ...).
+    OpAddLocalConst,            // r k g site
+    OpSubLocalConst,            // r k g site
+    OpJumpUnlessEqualLocalConst,       // r k g site t
+    OpJumpUnlessLessEqualLocalConst,   // r k g site t
+
+    OpCount_
+};
+
+// Core.cpp's builtins which have an opcode, and how many arguments that
+// opcode takes.
+static const struct {
+    const char* name;
+    OpCode      op;
+    int         argCount;
+} builtinOps[] = {
+    { "+",      OpAdd,       2 },
+    { "-",      OpSub,       2 },
+    { "<=",     OpLessEqual, 2 },
+    { "=",      OpEqual,     2 },
+    { "first",  OpFirst,     1 },
+    { "rest",   OpRest,      1 },
+    { "count",  OpCount,     1 },
+    { "empty?", OpEmpty,     1 },
+};
+
+struct Global {
+    const malSymbol*     symbol;
+    mutable malValuePtr* cell;
+    malValuePtr          builtin; // what an opcode expects it to be bound to
+};
+
+struct Outer {
+    int              depth;
+    int              slot;
+    const malSymbol* symbol;
+};
+
+// A call remembers its form and the registers in scope, so that it can be
+// handed to the interpreter if its head turns out to be a macro.
+struct Site {
+    malValuePtr form;
+    std::vector<std::pair<const malSymbol*, int> > locals;
+};
+
+struct Guard {
+    malValuePtr* cell;
+    malValuePtr  macro;
+};
+
+class Bytecode : public malCode {
+public:
+    Bytecode(malCodePtr fallback) : m_fallback(fallback) { }
+
+    virtual malValuePtr exec(const malEnvPtr& env, malTailCall& tail) const;
+
+private:
+    friend class Assembler;
+
+    malValuePtr global(int g, const malEnvPtr& env) const;
+    malValuePtr call(const malValuePtr& op, malValuePtr* args,
+                     int n, int site, const malEnvPtr& env,
+                     const malValuePtr* regs, malTailCall* tail) const;
+    malValuePtr callBuiltin(int g, malValuePtr* args,
+                            int n, int site, const malEnvPtr& env,
+                            const malValuePtr* regs) const;
+
+    std::vector<int>    m_code;
+    malValueVec         m_consts;
+    std::vector<Global> m_globals;
+    std::vector<Outer>  m_outers;
+    std::vector<Site>   m_sites;
+    std::vector<Guard>  m_guards;
+    malSymbolVec        m_params;
+    int                 m_registers;
+    int                 m_stackSize;
+    malCodePtr          m_fallback;
+};
+
+// Thrown when the body uses something the VM doesn't handle.
+struct Unsupported { };
+
+class Assembler {
+public:
+    Assembler(Bytecode* code, const malScope* scope, malEnvPtr env);
+
+    void compile(malValuePtr ast, bool isTail);
+    void emit(int op) { m_bytecode->m_code.push_back(op); }
+
+private:
+    struct Local {
+        const malSymbol* symbol;
+        int              reg;
+    };
+
+    void compileList(malValuePtr ast, const malList* list, bool isTail);
+    void compileSymbol(const malSymbol* symbol);
+    bool compileBuiltin(const malSymbol* symbol, malValuePtr ast,
+                        const malList* list);
+    void compileTest(malValuePtr ast, std::vector<int>& falseJumps);
+    bool compileSuper(malValuePtr ast, const malList* list, OpCode op,
+                      std::vector<int>* falseJumps);
+    void compileCall(malValuePtr ast, const malList* list, bool isTail);
+
+    int constant(malValuePtr value);
+    int global(const malSymbol* symbol);
+    int site(malValuePtr form);
+    int localRegister(const malSymbol* symbol);
+    const malLambda* globalMacro(const malSymbol* symbol, malValuePtr** cell);
+    int label() { return m_bytecode->m_code.size(); }
+    void patch(int at) { m_bytecode->m_code[at] = label(); }
+    void push(int n = 1);
+    void pop(int n = 1) { m_depth -= n; }
+
+    Bytecode*          m_bytecode;
+    const malScope*    m_outer;
+    malEnvPtr          m_env;
+    std::vector<Local> m_locals;
+    int                m_depth;
+};
+
+Assembler::Assembler(Bytecode* code, const malScope* scope, malEnvPtr env)
+: m_bytecode(code)
+, m_outer(scope->outer)
+, m_env(env)
+, m_depth(0)
+{
+    code->m_params = scope->names;
+    code->m_registers = scope->names.size();
+    code->m_stackSize = 0;
+    for (int i = 0, count = scope->names.size(); i < count; i++) {
+        m_locals.push_back(Local { scope->names[i], i });
+    }
+}
+
+void Assembler::push(int n)
+{
+    m_depth += n;
+    m_bytecode->m_stackSize = std::max(m_bytecode->m_stackSize, m_depth);
+}
+
+int Assembler::constant(malValuePtr value)
+{
+    m_bytecode->m_consts.push_back(value);
+    return m_bytecode->m_consts.size() - 1;
+}
+
+int Assembler::global(const malSymbol* symbol)
+{
+    symbol = symbol->interned();
+    std::vector<Global>& globals = m_bytecode->m_globals;
+    for (int i = 0, count = globals.size(); i < count; i++) {
+        if (globals[i].symbol == symbol) {
+            return i;
+        }
+    }
+    globals.push_back(Global { symbol, NULL, malValuePtr() });
+    return globals.size() - 1;
+}
+
+int Assembler::site(malValuePtr form)
+{
+    Site site;
+    site.form = form;
+    for (auto it = m_locals.begin(), end = m_locals.end(); it != end; ++it) {
+        site.locals.push_back(std::make_pair(it->symbol, it->reg));
+    }
+    m_bytecode->m_sites.push_back(site);
+    return m_bytecode->m_sites.size() - 1;
+}
+
+int Assembler::localRegister(const malSymbol* symbol)
+{
+    // The innermost binding wins.
+    for (auto it = m_locals.rbegin(), end = m_locals.rend(); it != end; ++it) {
+        if (it->symbol == symbol) {
+            return it->reg;
+        }
+    }
+    return -1;
+}
+
+void Assembler::compile(malValuePtr ast, bool isTail)
+{
+    if (const malList* list = DYNAMIC_CAST(malList, ast)) {
+        if (list->count() > 0) {
+            compileList(ast, list, isTail);
+            return;
+        }
+    }
+    else if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, ast)) {
+        compileSymbol(symbol->interned());
+        return;
+    }
+    else if (const malVector* vector = DYNAMIC_CAST(malVector, ast)) {
+        int count = vector->count();
+        for (int i = 0; i < count; i++) {
+            compile(vector->item(i), false);
+        }
+        emit(OpVector);
+        emit(count);
+        pop(count);
+        push();
+        return;
+    }
+    else if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        // Only a map literal needs its values evaluated.
+        if (!hash->isEvaluated()) {
+            throw Unsupported();
+        }
+    }
+    emit(OpConst);
+    emit(constant(ast));
+    push();
+}
+
+void Assembler::compileSymbol(const malSymbol* symbol)
+{
+    int reg = localRegister(symbol);
+    if (reg >= 0) {
+        emit(OpLocal);
+        emit(reg);
+        push();
+        return;
+    }
+
+    // The enclosing frames are still malEnvs. The call's own frame holds the
+    // parameters, so the nearest enclosing one is at depth 1, as it is for
+    // the closure compiler.
+    int depth = 1;
+    for (const malScope* scope = m_outer; scope; scope = scope->outer) {
+        int slot = scope->slot(symbol);
+        if (slot >= 0) {
+            m_bytecode->m_outers.push_back(Outer { depth, slot, symbol });
+            emit(OpOuter);
+            emit(m_bytecode->m_outers.size() - 1);
+            push();
+            return;
+        }
+        depth++;
+    }
+
+    emit(OpGlobal);
+    emit(global(symbol));
+    push();
+}
+
+const malLambda* Assembler::globalMacro(const malSymbol* symbol,
+                                        malValuePtr** cell)
+{
+    if (localRegister(symbol) >= 0) {
+        return NULL;
+    }
+    for (const malScope* scope = m_outer; scope; scope = scope->outer) {
+        auto end = scope->names.end();
+        if (std::find(scope->names.begin(), end, symbol) != end) {
+            return NULL;
+        }
+    }
+    *cell = m_env->globalCell(symbol);
+    const malLambda* macro = *cell ? DYNAMIC_CAST(malLambda, **cell) : NULL;
+    return macro && macro->isMacro() ? macro : NULL;
+}
+
+void Assembler::compileList(malValuePtr ast, const malList* list,
+                            bool isTail)
+{
+    const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0));
+    if (!symbol) {
+        compileCall(ast, list, isTail);
+        return;
+    }
+    symbol = symbol->interned();
+    int argCount = list->count() - 1;
+
+    switch (symbol->specialForm()) {
+        case NotSpecial:
+            break;
+
+        case SpecialDo: {
+            checkArgsAtLeast("do", 1, argCount);
+            for (int i = 1; i < argCount; i++) {
+                compile(list->item(i), false);
+                emit(OpPop);
+                pop();
+            }
+            compile(list->item(argCount), isTail);
+            return;
+        }
+
+        case SpecialIf: {
+            checkArgsBetween("if", 2, 3, argCount);
+            std::vector<int> falseJumps;
+            compileTest(list->item(1), falseJumps);
+            compile(list->item(2), isTail);
+            pop();
+            emit(OpJump);
+            int endJump = label();
+            emit(0);
+            for (auto it = falseJumps.begin(); it != falseJumps.end(); ++it) {
+                patch(*it);
+            }
+            if (argCount == 3) {
+                compile(list->item(3), isTail);
+            }
+            else {
+                emit(OpConst);
+                emit(constant(mal::nilValue()));
+                push();
+            }
+            patch(endJump);
+            return;
+        }
+
+        case SpecialLet: {
+            checkArgsIs("let*", 2, argCount);
+            const malSequence* bindings =
+                VALUE_CAST(malSequence, list->item(1));
+            int count = checkArgsEven("let*", bindings->count());
+
+            // Nothing can capture these registers, so a name can be given a
+            // new one each time it's bound, once its value is known.
+            int locals = m_locals.size();
+            for (int i = 0; i < count; i += 2) {
+                const malSymbol* var =
+                    VALUE_CAST(malSymbol, bindings->item(i));
+                compile(bindings->item(i+1), false);
+                int reg = m_bytecode->m_registers++;
+                emit(OpStore);
+                emit(reg);
+                pop();
+                m_locals.push_back(Local { var->interned(), reg });
+            }
+            compile(list->item(2), isTail);
+            m_locals.resize(locals);
+            return;
+        }
+
+        case SpecialQuasiQuote: {
+            checkArgsIs("quasiquote", 1, argCount);
+            compile(quasiquote(list->item(1)), isTail);
+            return;
+        }
+
+        case SpecialQuote: {
+            checkArgsIs("quote", 1, argCount);
+            emit(OpConst);
+            emit(constant(list->item(1)));
+            push();
+            return;
+        }
+
+        default:
+            throw Unsupported();
+    }
+
+    // The closure compiler has just expanded the body's macros, and kept
+    // each expansion on its form, so the macro isn't run again here. If the
+    // macro has changed since, which it can do as it expands, the closures
+    // are left to sort it out. The function also falls back to its closures
+    // if one of them is redefined later.
+    malValuePtr* cell = NULL;
+    if (globalMacro(symbol, &cell)) {
+        const malCallSite& site = list->callSite();
+        if (site.expandedBy != *cell) {
+            throw Unsupported();
+        }
+        m_bytecode->m_guards.push_back(Guard { cell, *cell });
+        compile(site.expansion, isTail);
+        return;
+    }
+
+    if (!compileBuiltin(symbol, ast, list)) {
+        compileCall(ast, list, isTail);
+    }
+}
+
+bool Assembler::compileBuiltin(const malSymbol* symbol, malValuePtr ast,
+                               const malList* list)
+{
+    malValuePtr* cell = NULL;
+    if (globalMacro(symbol, &cell) || !cell) {
+        return false;
+    }
+    const malBuiltIn* builtin = DYNAMIC_CAST(malBuiltIn, *cell);
+    if (!builtin) {
+        return false;
+    }
+
+    int argCount = list->count() - 1;
+    for (auto& entry : builtinOps) {
+        if ((entry.argCount == argCount) && (builtin->name() == entry.name) &&
+                (symbol->value() == entry.name)) {
+            if (entry.op == OpAdd && compileSuper(ast, list, OpAddLocalConst,
+                                                  NULL)) {
+                return true;
+            }
+            if (entry.op == OpSub && compileSuper(ast, list, OpSubLocalConst,
+                                                  NULL)) {
+                return true;
+            }
+            for (int i = 1; i <= argCount; i++) {
+                compile(list->item(i), false);
+            }
+            int g = global(symbol);
+            m_bytecode->m_globals[g].builtin = *cell;
+            emit(entry.op);
+            emit(g);
+            emit(site(ast));
+            pop(argCount);
+            push();
+            return true;
+        }
+    }
+    return false;
+}
+
+// Compiles (op register constant), where op is still the builtin it was
+// when this was compiled, and the constant is a small integer.
+bool Assembler::compileSuper(malValuePtr ast, const malList* list, OpCode op,
+                             std::vector<int>* falseJumps)
+{
+    if (list->count() != 3) {
+        return false;
+    }
+    const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0));
+    const malSymbol* arg = DYNAMIC_CAST(malSymbol, list->item(1));
+    malValuePtr constValue = list->item(2);
+    if (!symbol || !arg || !constValue.isInteger()) {
+        return false;
+    }
+    int reg = localRegister(arg->interned());
+    malValuePtr* cell = NULL;
+    if ((reg < 0) || globalMacro(symbol->interned(), &cell) || !cell) {
+        return false;
+    }
+
+    int g = global(symbol);
+    m_bytecode->m_globals[g].builtin = *cell;
+    emit(op);
+    emit(reg);
+    emit(constant(constValue));
+    emit(g);
+    emit(site(ast));
+    if (falseJumps) {
+        falseJumps->push_back(label());
+        emit(0);
+    }
+    else {
+        push();
+    }
+    // The slow path pushes both operands.
+    push(2);
+    pop(2);
+    return true;
+}
+
+// Compiles an if's test, jumping to one of falseJumps if it's false.
+void Assembler::compileTest(malValuePtr ast, std::vector<int>& falseJumps)
+{
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    const malSymbol* symbol =
+        list && list->count() == 3 ? DYNAMIC_CAST(malSymbol, list->item(0))
+                                   : NULL;
+    if (symbol && !symbol->specialForm()) {
+        malValuePtr* cell = NULL;
+        const malBuiltIn* builtin = NULL;
+        if (!globalMacro(symbol->interned(), &cell) && cell) {
+            builtin = DYNAMIC_CAST(malBuiltIn, *cell);
+        }
+        if (builtin && (symbol->value() == builtin->name())) {
+            if ((builtin->name() == "=") &&
+                compileSuper(ast, list, OpJumpUnlessEqualLocalConst,
+                             &falseJumps)) {
+                return;
+            }
+            if ((builtin->name() == "<=") &&
+                compileSuper(ast, list, OpJumpUnlessLessEqualLocalConst,
+                             &falseJumps)) {
+                return;
+            }
+        }
+    }
+
+    compile(ast, false);
+    emit(OpJumpIfFalse);
+    falseJumps.push_back(label());
+    emit(0);
+    pop();
+}
+
+void Assembler::compileCall(malValuePtr ast, const malList* list,
+                            bool isTail)
+{
+    int count = list->count();
+    for (int i = 0; i < count; i++) {
+        compile(list->item(i), false);
+    }
+    emit(isTail ? OpTailCall : OpCall);
+    emit(count - 1);
+    emit(site(ast));
+    pop(count);
+    push();
+}
+
+malValuePtr Bytecode::global(int g, const malEnvPtr& env) const
+{
+    const Global& global = m_globals[g];
+    if (!global.cell) {
+        // Global cells never move, so once found it's kept.
+        global.cell = env->globalCell(global.symbol);
+        MAL_CHECK(global.cell, "'%s' not found",
+                  global.symbol->value().c_str());
+    }
+    return *global.cell;
+}
+
+malValuePtr Bytecode::call(const malValuePtr& op, malValuePtr* args, int n,
+                           int site,
+                           const malEnvPtr& env, const malValuePtr* regs,
+                           malTailCall* tail) const
+{
+    malValueIter begin = ArgStack::iterator(args);
+    malValueIter end = begin + n;
+
+    if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
+        if (lambda->isMacro()) {
+            // It wasn't a macro when this was compiled, so the interpreter
+            // gets the call, with the registers in scope bound by name.
+            const Site& s = m_sites[site];
+            malEnvPtr inner(new malEnv(env));
+            for (auto it = s.locals.begin(), e = s.locals.end(); it != e;
+                    ++it) {
+                inner->bind(it->first, regs[it->second]);
+            }
+            return interpret(s.form, inner);
+        }
+        if (const malCodePtr& code = lambda->getCode()) {
+            malEnvPtr inner = lambda->makeEnv(begin, end);
+            if (tail) {
+                tail->code = code;
+                tail->env = std::move(inner);
+                return malValuePtr();
+            }
+            return code->run(std::move(inner));
+        }
+    }
+    return APPLY(op, begin, end);
+}
+
+// The slow path for a builtin opcode, whose global may since have been
+// bound to something else.
+malValuePtr Bytecode::callBuiltin(int g, malValuePtr* args, int n,
+                                  int site,
+                                  const malEnvPtr& env,
+                                  const malValuePtr* regs) const
+{
+    return call(global(g, env), args, n, site, env, regs, NULL);
+}
+
+malValuePtr Bytecode::exec(const malEnvPtr& env, malTailCall& tail) const
+{
+    for (auto it = m_guards.begin(), end = m_guards.end(); it != end; ++it) {
+        if (*it->cell != it->macro) {
+            return m_fallback->exec(env, tail);
+        }
+    }
+
+    // The registers and operand stack go on the argument stack, so that
+    // calls can take their arguments straight from it.
+    ArgStack::Frame frame;
+    for (int i = 0, size = m_registers + m_stackSize; i < size; i++) {
+        frame.push(malValuePtr());
+    }
+    malValuePtr* regs = &frame[0];
+    for (int i = 0, count = m_params.size(); i < count; i++) {
+        regs[i] = *env->local(0, i, m_params[i]);
+    }
+    malValuePtr* sp = regs + m_registers;
+    const int* pc = m_code.data();
+    const malValuePtr* consts = m_consts.data();
+
+    // Where the builtin for an opcode is still what it was compiled
+    // against.
+    #define IS_BUILTIN(g) \
+        (m_globals[g].cell && (*m_globals[g].cell == m_globals[g].builtin))
+
+#if defined(__GNUC__)
+    // Each opcode jumps straight to the next one's handler.
+    static void* const labels[] = {
+        &&op_Const, &&op_Local, &&op_Outer, &&op_Global, &&op_Store,
+        &&op_Pop, &&op_Jump, &&op_JumpIfFalse, &&op_Call, &&op_TailCall,
+        &&op_Return, &&op_Vector, &&op_Add, &&op_Sub, &&op_LessEqual,
+        &&op_Equal, &&op_First, &&op_Rest, &&op_Count, &&op_Empty,
+        &&op_AddLocalConst, &&op_SubLocalConst,
+        &&op_JumpUnlessEqualLocalConst, &&op_JumpUnlessLessEqualLocalConst,
+    };
+    static_assert(sizeof(labels) / sizeof(labels[0]) == OpCount_,
+                  "every opcode needs a label");
+    #define DISPATCH()  goto *labels[*pc++]
+    #define CASE(op)    op_##op
+    #define NEXT        DISPATCH()
+    DISPATCH();
+#else
+    #define CASE(op)    case Op##op
+    #define NEXT        continue
+    while (1) switch (*pc++) {
+#endif
+
+    CASE(Const):
+        *sp++ = consts[*pc++];
+        NEXT;
+
+    CASE(Local):
+        *sp++ = regs[*pc++];
+        NEXT;
+
+    CASE(Outer): {
+        const Outer& outer = m_outers[*pc++];
+        malValuePtr* value = env->local(outer.depth, outer.slot,
+                                        outer.symbol);
+        if (value) {
+            vmStats().outerHits++;
+            *sp++ = *value;
+        }
+        else {
+            vmStats().outerMisses++;
+            *sp++ = env->get(outer.symbol);
+        }
+        NEXT;
+    }
+
+    CASE(Global):
+        *sp++ = global(*pc++, env);
+        NEXT;
+
+    CASE(Store):
+        regs[*pc++] = std::move(*--sp);
+        NEXT;
+
+    CASE(Pop):
+        *--sp = malValuePtr();
+        NEXT;
+
+    CASE(Jump):
+        pc = m_code.data() + *pc;
+        NEXT;
+
+    CASE(JumpIfFalse): {
+        bool isTrue = (*--sp)->isTrue();
+        *sp = malValuePtr();
+        if (isTrue) {
+            pc++;
+        }
+        else {
+            pc = m_code.data() + *pc;
+        }
+        NEXT;
+    }
+
+    CASE(Call): {
+        int n = *pc++;
+        int site = *pc++;
+        malValuePtr* base = sp - n - 1;
+        malValuePtr result = call(*base, base + 1, n, site, env,
+                                  regs, NULL);
+        while (sp != base) {
+            *--sp = malValuePtr();
+        }
+        *sp++ = std::move(result);
+        NEXT;
+    }
+
+    CASE(TailCall): {
+        int n = *pc++;
+        int site = *pc++;
+        malValuePtr* base = sp - n - 1;
+        return call(*base, base + 1, n, site, env, regs, &tail);
+    }
+
+    CASE(Return):
+        return std::move(*--sp);
+
+    CASE(Vector): {
+        int n = *pc++;
+        malValuePtr value = mal::vector(ArgStack::iterator(sp - n),
+                                        ArgStack::iterator(sp));
+        while (n-- > 0) {
+            *--sp = malValuePtr();
+        }
+        *sp++ = std::move(value);
+        NEXT;
+    }
+
+    // The builtin opcodes each pop their arguments and push the result.
+    #define BUILTIN_OP(argCount, fastPath)                                   \
+        {                                                                    \
+            int g = *pc++;                                                   \
+            int site = *pc++;                                                \
+            malValuePtr* args = sp - argCount;                               \
+            malValuePtr result;                                              \
+            if (IS_BUILTIN(g)) {                                             \
+                fastPath;                                                    \
+            }                                                                \
+            if (!result) {                                                   \
+                result = callBuiltin(g, args, argCount, site, env, regs);    \
+            }                                                                \
+            while (sp != args) {                                             \
+                *--sp = malValuePtr();                                       \
+            }                                                                \
+            *sp++ = std::move(result);                                       \
+            NEXT;                                                            \
+        }
+
+    CASE(Add):
+        BUILTIN_OP(2,
+            if (args[0].isInteger() && args[1].isInteger()) {
+                result = mal::integer(args[0].integerValue() +
+                                      args[1].integerValue());
+            })
+
+    CASE(Sub):
+        BUILTIN_OP(2,
+            if (args[0].isInteger() && args[1].isInteger()) {
+                result = mal::integer(args[0].integerValue() -
+                                      args[1].integerValue());
+            })
+
+    CASE(LessEqual):
+        BUILTIN_OP(2,
+            if (args[0].isInteger() && args[1].isInteger()) {
+                result = mal::boolean(args[0].integerValue() <=
+                                      args[1].integerValue());
+            })
+
+    CASE(Equal):
+        BUILTIN_OP(2, result = mal::boolean(mal::isEqual(args[0], args[1])))
+
+    CASE(First):
+        BUILTIN_OP(1,
+            if (const malSequence* seq = DYNAMIC_CAST(malSequence, args[0])) {
+                result = seq->first();
+            })
+
+    CASE(Rest):
+        BUILTIN_OP(1,
+            if (const malSequence* seq = DYNAMIC_CAST(malSequence, args[0])) {
+                result = seq->rest();
+            })
+
+    CASE(Count):
+        BUILTIN_OP(1,
+            if (const malSequence* seq = DYNAMIC_CAST(malSequence, args[0])) {
+                result = mal::integer(seq->count());
+            })
+
+    CASE(Empty):
+        BUILTIN_OP(1,
+            if (const malSequence* seq = DYNAMIC_CAST(malSequence, args[0])) {
+                result = mal::boolean(seq->isEmpty());
+            })
+
+    // The superinstructions push their operands only on the slow path.
+    #define SUPER_OP(fastPath)                                               \
+        int reg = *pc++;                                                     \
+        const malValuePtr& constant = consts[*pc++];                         \
+        int g = *pc++;                                                       \
+        int site = *pc++;                                                    \
+        const malValuePtr& value = regs[reg];                                \
+        malValuePtr result;                                                  \
+        if (IS_BUILTIN(g) && value.isInteger()) {                            \
+            int64_t lhs = value.integerValue();                              \
+            int64_t rhs = constant.integerValue();                           \
+            fastPath;                                                        \
+        }                                                                    \
+        else {                                                               \
+            sp[0] = value;                                                   \
+            sp[1] = constant;                                                \
+            result = callBuiltin(g, sp, 2, site, env, regs);                 \
+            sp[0] = malValuePtr();                                           \
+            sp[1] = malValuePtr();                                           \
+        }
+
+    CASE(AddLocalConst): {
+        SUPER_OP(result = mal::integer(lhs + rhs))
+        *sp++ = std::move(result);
+        NEXT;
+    }
+
+    CASE(SubLocalConst): {
+        SUPER_OP(result = mal::integer(lhs - rhs))
+        *sp++ = std::move(result);
+        NEXT;
+    }
+
+    CASE(JumpUnlessEqualLocalConst): {
+        SUPER_OP(result = mal::boolean(lhs == rhs))
+        if (result->isTrue()) {
+            pc++;
+        }
+        else {
+            pc = m_code.data() + *pc;
+        }
+        NEXT;
+    }
+
+    CASE(JumpUnlessLessEqualLocalConst): {
+        SUPER_OP(result = mal::boolean(lhs <= rhs))
+        if (result->isTrue()) {
+            pc++;
+        }
+        else {
+            pc = m_code.data() + *pc;
+        }
+        NEXT;
+    }
+
+#if !defined(__GNUC__)
+    }
+#endif
+
+    #undef IS_BUILTIN
+    #undef DISPATCH
+    #undef CASE
+    #undef NEXT
+    #undef BUILTIN_OP
+    #undef SUPER_OP
+}
+
+} // namespace
+
+malCodePtr compileBytecode(malValuePtr body, const malScope* scope,
+                           malEnvPtr env, malCodePtr fallback)
+{
+    Bytecode* code = new Bytecode(fallback);
+    malCodePtr result(code);
+    try {
+        Assembler assembler(code, scope, env);
+        assembler.compile(body, true);
+        assembler.emit(OpReturn);
+    }
+    catch (Unsupported&) {
+        return NULL;
+    }
+    catch (String&) {
+        return NULL;
+    }
+    catch (malValuePtr&) {
+        return NULL;
+    }
+    return result;
+}
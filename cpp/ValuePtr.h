@@ -0,0 +1,97 @@
+#ifndef INCLUDE_VALUEPTR_H
+#define INCLUDE_VALUEPTR_H
+
+#include <cstddef>
+#include <cstdint>
+
+class malValue;
+
+// A reference to a mal value. Most values are refcounted objects on the
+// heap, but small integers are held directly in the pointer bits, and the
+// nil/true/false constants are never refcounted. The low two bits say which:
+//
+//   00  refcounted malValue* (or NULL)
+//   01  immediate integer, in the remaining bits
+//   10  unmanaged malValue*, which lives forever
+//
+// operator-> works for all of them. For an immediate integer it points at a
+// temporary malInteger which lives until the end of the full expression, so
+// don't hang on to the pointer. ptr() is NULL for immediate integers.
+//
+// Code which only looks at a value borrows it, as a const malValuePtr&,
+// which costs no refcounting. Sequences hand out their items that way too,
+// so a borrowed item is only good while its sequence is alive. Code which
+// keeps a value takes it by value and moves it into place.
+//
+// The inline definitions live in Types.h, where malValue and malInteger are
+// complete.
+class malValuePtr {
+public:
+    malValuePtr() : m_bits(0) { }
+    malValuePtr(malValue* object);
+    malValuePtr(const malValuePtr& rhs);
+    malValuePtr(malValuePtr&& rhs) noexcept : m_bits(rhs.m_bits) {
+        rhs.m_bits = 0;
+    }
+    ~malValuePtr();
+
+    const malValuePtr& operator = (const malValuePtr& rhs);
+    const malValuePtr& operator = (malValuePtr&& rhs) noexcept;
+
+    static malValuePtr integer(int64_t value);
+    static malValuePtr unmanaged(malValue* object);
+    static bool isImmediate(int64_t value) {
+        return (value >= MinImmediate) && (value <= MaxImmediate);
+    }
+
+    bool isInteger() const { return (m_bits & TagMask) == IntegerTag; }
+    int64_t integerValue() const {
+        return static_cast<intptr_t>(m_bits) >> TagBits;
+    }
+
+    bool operator == (const malValuePtr& rhs) const {
+        return m_bits == rhs.m_bits;
+    }
+
+    bool operator != (const malValuePtr& rhs) const {
+        return m_bits != rhs.m_bits;
+    }
+
+    operator bool () const {
+        return m_bits != 0;
+    }
+
+    class Arrow;
+    Arrow operator -> () const;
+
+    malValue* ptr() const {
+        return isInteger() ? NULL
+                           : reinterpret_cast<malValue*>(m_bits & ~TagMask);
+    }
+
+private:
+    friend class RefVisitor;
+
+    enum {
+        TagBits      = 2,
+        TagMask      = 3,
+        ManagedTag   = 0,
+        IntegerTag   = 1,
+        UnmanagedTag = 2,
+    };
+    static const intptr_t MinImmediate = INTPTR_MIN >> TagBits;
+    static const intptr_t MaxImmediate = INTPTR_MAX >> TagBits;
+
+    explicit malValuePtr(uintptr_t bits, bool) : m_bits(bits) { }
+
+    bool isManaged() const {
+        return (m_bits != 0) && ((m_bits & TagMask) == ManagedTag);
+    }
+
+    void acquire() const;
+    void release() const;
+
+    uintptr_t m_bits;
+};
+
+#endif // INCLUDE_VALUEPTR_H
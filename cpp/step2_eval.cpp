@@ -59,7 +59,7 @@ String PRINT(malValuePtr ast)
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op, malValueIter argsBegin, malValueIter argsEnd)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
@@ -69,6 +69,7 @@ malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
 }
 
 #define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
+#define ARG_INT(name)   int64_t name = INTEGER_CAST(*argsBegin++)
 
 #define CHECK_ARGS_IS(expected) \
     checkArgsIs(name.c_str(), expected, std::distance(argsBegin, argsEnd))
@@ -81,38 +82,38 @@ static malValuePtr builtIn_add(const String& name,
     malValueIter argsBegin, malValueIter argsEnd)
 {
         CHECK_ARGS_IS(2);
-        ARG(malInteger, lhs);
-        ARG(malInteger, rhs);
-        return mal::integer(lhs->value() + rhs->value());
+        ARG_INT(lhs);
+        ARG_INT(rhs);
+        return mal::integer(lhs + rhs);
 }
 
 static malValuePtr builtIn_sub(const String& name,
     malValueIter argsBegin, malValueIter argsEnd)
 {
         int argCount = CHECK_ARGS_BETWEEN(1, 2);
-        ARG(malInteger, lhs);
+        ARG_INT(lhs);
         if (argCount == 1) {
-            return mal::integer(- lhs->value());
+            return mal::integer(- lhs);
         }
-        ARG(malInteger, rhs);
-        return mal::integer(lhs->value() - rhs->value());
+        ARG_INT(rhs);
+        return mal::integer(lhs - rhs);
 }
 
 static malValuePtr builtIn_mul(const String& name,
     malValueIter argsBegin, malValueIter argsEnd)
 {
         CHECK_ARGS_IS(2);
-        ARG(malInteger, lhs);
-        ARG(malInteger, rhs);
-        return mal::integer(lhs->value() * rhs->value());
+        ARG_INT(lhs);
+        ARG_INT(rhs);
+        return mal::integer(lhs * rhs);
 }
 
 static malValuePtr builtIn_div(const String& name,
     malValueIter argsBegin, malValueIter argsEnd)
 {
         CHECK_ARGS_IS(2);
-        ARG(malInteger, lhs);
-        ARG(malInteger, rhs);
-        MAL_CHECK(rhs->value() != 0, "Division by zero"); \
-        return mal::integer(lhs->value() / rhs->value());
+        ARG_INT(lhs);
+        ARG_INT(rhs);
+        MAL_CHECK(rhs != 0, "Division by zero"); \
+        return mal::integer(lhs / rhs);
 }
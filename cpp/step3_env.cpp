@@ -64,7 +64,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         if (special == "def!") {
             checkArgsIs("def!", 2, argCount);
             const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-            return env->set(id->value(), EVAL(list->item(2), env));
+            return env->set(id, EVAL(list->item(2), env));
         }
 
         if (special == "let*") {
@@ -76,7 +76,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             for (int i = 0; i < count; i += 2) {
                 const malSymbol* var =
                     VALUE_CAST(malSymbol, bindings->item(i));
-                inner->set(var->value(), EVAL(bindings->item(i+1), inner));
+                inner->set(var, EVAL(bindings->item(i+1), inner));
             }
             return EVAL(list->item(2), inner);
         }
@@ -93,7 +93,7 @@ String PRINT(malValuePtr ast)
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op, malValueIter argsBegin, malValueIter argsEnd)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
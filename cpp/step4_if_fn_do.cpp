@@ -66,7 +66,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         if (special == "def!") {
             checkArgsIs("def!", 2, argCount);
             const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-            return env->set(id->value(), EVAL(list->item(2), env));
+            return env->set(id, EVAL(list->item(2), env));
         }
 
         if (special == "do") {
@@ -83,11 +83,11 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 
             const malSequence* bindings =
                 VALUE_CAST(malSequence, list->item(1));
-            StringVec params;
+            malSymbolVec params;
             for (int i = 0; i < bindings->count(); i++) {
                 const malSymbol* sym =
                     VALUE_CAST(malSymbol, bindings->item(i));
-                params.push_back(sym->value());
+                params.push_back(sym->interned());
             }
 
             return mal::lambda(params, list->item(2), env);
@@ -112,7 +112,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             for (int i = 0; i < count; i += 2) {
                 const malSymbol* var =
                     VALUE_CAST(malSymbol, bindings->item(i));
-                inner->set(var->value(), EVAL(bindings->item(i+1), inner));
+                inner->set(var, EVAL(bindings->item(i+1), inner));
             }
             return EVAL(list->item(2), inner);
         }
@@ -135,7 +135,7 @@ String PRINT(malValuePtr ast)
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op, malValueIter argsBegin, malValueIter argsEnd)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
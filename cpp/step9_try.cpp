@@ -100,7 +100,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             if (special == "def!") {
                 checkArgsIs("def!", 2, argCount);
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                return env->set(id->value(), EVAL(list->item(2), env));
+                return env->set(id, EVAL(list->item(2), env));
             }
 
             if (special == "defmacro!") {
@@ -109,7 +109,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
                 malValuePtr body = EVAL(list->item(2), env);
                 const malLambda* lambda = VALUE_CAST(malLambda, body);
-                return env->set(id->value(), mal::macro(*lambda));
+                return env->set(id, mal::macro(*lambda));
             }
 
             if (special == "do") {
@@ -127,11 +127,11 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 
                 const malSequence* bindings =
                     VALUE_CAST(malSequence, list->item(1));
-                StringVec params;
+                malSymbolVec params;
                 for (int i = 0; i < bindings->count(); i++) {
                     const malSymbol* sym =
                         VALUE_CAST(malSymbol, bindings->item(i));
-                    params.push_back(sym->value());
+                    params.push_back(sym->interned());
                 }
 
                 return mal::lambda(params, list->item(2), env);
@@ -157,7 +157,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 for (int i = 0; i < count; i += 2) {
                     const malSymbol* var =
                         VALUE_CAST(malSymbol, bindings->item(i));
-                    inner->set(var->value(), EVAL(bindings->item(i+1), inner));
+                    inner->set(var, EVAL(bindings->item(i+1), inner));
                 }
                 ast = list->item(2);
                 env = inner;
@@ -215,7 +215,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 if (excVal) {
                     // we got some exception
                     env = malEnvPtr(new malEnv(env));
-                    env->set(excSym->value(), excVal);
+                    env->set(excSym, excVal);
                     ast = catchBlock->item(2);
                 }
                 continue; // TCO
@@ -241,7 +241,7 @@ String PRINT(malValuePtr ast)
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op, malValueIter argsBegin, malValueIter argsEnd)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
@@ -298,9 +298,10 @@ static malValuePtr quasiquote(malValuePtr obj)
 
 static const malLambda* isMacroApplication(malValuePtr obj, malEnvPtr env)
 {
-    if (const malSequence* seq = isPair(obj)) {
+    const malList* seq = DYNAMIC_CAST(malList, obj);
+    if (seq && !seq->isEmpty()) {
         if (malSymbol* sym = DYNAMIC_CAST(malSymbol, seq->first())) {
-            if (malEnvPtr symEnv = env->find(sym->value())) {
+            if (malEnvPtr symEnv = env->find(sym)) {
                 malValuePtr value = sym->eval(symEnv);
                 if (malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
                     return lambda->isMacro() ? lambda : NULL;
@@ -314,8 +315,8 @@ static const malLambda* isMacroApplication(malValuePtr obj, malEnvPtr env)
 static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
 {
     while (const malLambda* macro = isMacroApplication(obj, env)) {
-        const malSequence* seq = STATIC_CAST(malSequence, obj);
-        obj = macro->apply(seq->begin() + 1, seq->end());
+        const malList* seq = STATIC_CAST(malList, obj);
+        obj = seq->applyArgs(macro);
     }
     return obj;
 }
@@ -338,8 +339,6 @@ static const char* malFunctionTable[] = {
     "(def! >= (fn* (a b) (<= b a)))",
     "(def! < (fn* (a b) (not (<= b a))))",
     "(def! > (fn* (a b) (not (<= a b))))",
-    "(def! load-file (fn* (filename) \
-        (eval (read-string (str \"(do \" (slurp filename) \")\")))))",
     "(def! map (fn* (f xs) (if (empty? xs) xs \
         (cons (f (first xs)) (map f (rest xs))))))",
 };
@@ -1,30 +1,74 @@
 #include "MAL.h"
 
+#include "ArgStack.h"
+#include "Collector.h"
+#include "Compiler.h"
 #include "Environment.h"
+#include "EvalStack.h"
 #include "ReadLine.h"
 #include "Types.h"
 
+#include <cstdlib>
 #include <iostream>
-#include <memory>
+#include <utility>
 
 malValuePtr READ(const String& input);
 String PRINT(malValuePtr ast);
 static void installFunctions(malEnvPtr env);
 
+static int malMain(int argc, char* argv[]);
 static void makeArgv(malEnvPtr env, int argc, char* argv[]);
 static String safeRep(const String& input, malEnvPtr env);
-static malValuePtr quasiquote(malValuePtr obj);
-static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env);
+static malValuePtr macroExpand(malValuePtr obj, const malEnvPtr& env);
+static malValuePtr cachedOp(const malList* list);
+static malValuePtr evalOp(const malList* list, const malEnvPtr& env);
+static malValuePtr interpretList(const malValuePtr& form,
+                                 const malEnvPtr& formEnv);
 static void installMacros(malEnvPtr env);
+static void installSpecialForms();
 
 static ReadLine s_readLine("~/.mal-history");
 
 static malEnvPtr replEnv(new malEnv);
 
+// Top-level forms are either compiled, or interpreted by walking the AST.
+// Set MAL_ENGINE=closures to compile them to closures, or MAL_ENGINE=bytecode
+// to also run fn* bodies on the VM.
+static bool s_useCompiler = false;
+static bool s_useBytecode = false;
+
+// How deep evaluation can go before it raises an error. Set MAL_MAX_DEPTH
+// to change it.
+static const int s_defaultMaxDepth = 100000;
+
 int main(int argc, char* argv[])
+{
+    // Set MAL_GC_INTERVAL to change how many allocations there are between
+    // cycle collections.
+    if (const char* interval = getenv("MAL_GC_INTERVAL")) {
+        if (atoi(interval) > 0) {
+            Collector::setInterval(atoi(interval));
+        }
+    }
+    // Set MAL_FREE_SLICE to free at most that many objects at a time, so
+    // that dropping a large structure doesn't stall evaluation.
+    if (const char* slice = getenv("MAL_FREE_SLICE")) {
+        RefCounted::setDestroySlice(atoi(slice) > 0 ? atoi(slice) : 0);
+    }
+    const char* maxDepth = getenv("MAL_MAX_DEPTH");
+    int limit = maxDepth ? atoi(maxDepth) : 0;
+    return EvalStack::run(limit > 0 ? limit : s_defaultMaxDepth,
+                          malMain, argc, argv);
+}
+
+static int malMain(int argc, char* argv[])
 {
     String prompt = "user> ";
     String input;
+    const char* engine = getenv("MAL_ENGINE");
+    s_useBytecode = engine && (String(engine) == "bytecode");
+    s_useCompiler = s_useBytecode || (engine && (String(engine) == "closures"));
+    installSpecialForms();
     installCore(replEnv);
     installFunctions(replEnv);
     installMacros(replEnv);
@@ -80,159 +124,205 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
     if (!env) {
         env = replEnv;
     }
+    if (s_useCompiler && (env == replEnv)) {
+        return compile(ast, env, s_useBytecode)->run(std::move(env));
+    }
+    return interpret(std::move(ast), std::move(env));
+}
+
+malValuePtr interpret(const malValuePtr& ast, const malEnvPtr& env)
+{
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || (list->count() == 0)) {
+        return ast->eval(env);
+    }
+    return interpretList(ast, env);
+}
+
+static malValuePtr interpretList(const malValuePtr& form,
+                                 const malEnvPtr& formEnv)
+{
+    EvalStack::Level level;
+    Collector::safePoint();
+    // These only take references of their own when a tail call replaces
+    // them.
+    BorrowedPtr<malValuePtr> ast(form);
+    BorrowedPtr<malEnvPtr> env(formEnv);
     while (1) {
         const malList* list = DYNAMIC_CAST(malList, ast);
         if (!list || (list->count() == 0)) {
             return ast->eval(env);
         }
 
-        ast = macroExpand(ast, env);
-        list = DYNAMIC_CAST(malList, ast);
-        if (!list || (list->count() == 0)) {
-            return ast->eval(env);
+        // A call site which has already resolved its head to a function
+        // can't be a macro application.
+        malValuePtr op = cachedOp(list);
+        if (!op) {
+            ast = macroExpand(ast, env);
+            list = DYNAMIC_CAST(malList, ast);
+            if (!list || (list->count() == 0)) {
+                return ast->eval(env);
+            }
         }
 
         // From here on down we are evaluating a non-empty list.
-        // First handle the special forms.
-        if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-            String special = symbol->value();
+        // First handle the special forms, which a cached call site can't be.
+        const malSymbol* symbol =
+            op ? NULL : DYNAMIC_CAST(malSymbol, list->item(0));
+        if (symbol && symbol->specialForm()) {
             int argCount = list->count() - 1;
 
-            if (special == "def!") {
-                checkArgsIs("def!", 2, argCount);
-                const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                return env->set(id->value(), EVAL(list->item(2), env));
-            }
-
-            if (special == "defmacro!") {
-                checkArgsIs("defmacro!", 2, argCount);
-
-                const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                malValuePtr body = EVAL(list->item(2), env);
-                const malLambda* lambda = VALUE_CAST(malLambda, body);
-                return env->set(id->value(), mal::macro(*lambda));
-            }
-
-            if (special == "do") {
-                checkArgsAtLeast("do", 1, argCount);
-
-                for (int i = 1; i < argCount; i++) {
-                    EVAL(list->item(i), env);
+            switch (symbol->specialForm()) {
+                case SpecialDef: {
+                    checkArgsIs("def!", 2, argCount);
+                    const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
+                    return env->set(id, interpret(list->item(2), env));
                 }
-                ast = list->item(argCount);
-                continue; // TCO
-            }
 
-            if (special == "fn*") {
-                checkArgsIs("fn*", 2, argCount);
+                case SpecialDefMacro: {
+                    checkArgsIs("defmacro!", 2, argCount);
 
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                StringVec params;
-                for (int i = 0; i < bindings->count(); i++) {
-                    const malSymbol* sym =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    params.push_back(sym->value());
+                    const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
+                    malValuePtr body = interpret(list->item(2), env);
+                    const malLambda* lambda = VALUE_CAST(malLambda, body);
+                    return env->set(id, mal::macro(*lambda));
                 }
 
-                return mal::lambda(params, list->item(2), env);
-            }
-
-            if (special == "if") {
-                checkArgsBetween("if", 2, 3, argCount);
-
-                bool isTrue = EVAL(list->item(1), env)->isTrue();
-                if (!isTrue && (argCount == 2)) {
-                    return mal::nilValue();
-                }
-                ast = list->item(isTrue ? 2 : 3);
-                continue; // TCO
-            }
+                case SpecialDo: {
+                    checkArgsAtLeast("do", 1, argCount);
 
-            if (special == "let*") {
-                checkArgsIs("let*", 2, argCount);
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                int count = checkArgsEven("let*", bindings->count());
-                malEnvPtr inner(new malEnv(env));
-                for (int i = 0; i < count; i += 2) {
-                    const malSymbol* var =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    inner->set(var->value(), EVAL(bindings->item(i+1), inner));
+                    for (int i = 1; i < argCount; i++) {
+                        interpret(list->item(i), env);
+                    }
+                    ast = list->item(argCount);
+                    continue; // TCO
                 }
-                ast = list->item(2);
-                env = inner;
-                continue; // TCO
-            }
 
-            if (special == "macroexpand") {
-                checkArgsIs("macroexpand", 1, argCount);
-                return macroExpand(list->item(1), env);
-            }
+                case SpecialFn: {
+                    checkArgsIs("fn*", 2, argCount);
 
-            if (special == "quasiquote") {
-                checkArgsIs("quasiquote", 1, argCount);
-                ast = quasiquote(list->item(1));
-                continue; // TCO
-            }
+                    const malSequence* bindings =
+                        VALUE_CAST(malSequence, list->item(1));
+                    malSymbolVec params;
+                    for (int i = 0; i < bindings->count(); i++) {
+                        const malSymbol* sym =
+                            VALUE_CAST(malSymbol, bindings->item(i));
+                        params.push_back(sym->interned());
+                    }
 
-            if (special == "quote") {
-                checkArgsIs("quote", 1, argCount);
-                return list->item(1);
-            }
-
-            if (special == "try*") {
-                checkArgsIs("try*", 2, argCount);
-                malValuePtr tryBody = list->item(1);
-                const malList* catchBlock = VALUE_CAST(malList, list->item(2));
+                    return mal::lambda(params, list->item(2), env);
+                }
 
-                checkArgsIs("catch*", 2, catchBlock->count() - 1);
-                MAL_CHECK(VALUE_CAST(malSymbol,
-                    catchBlock->item(0))->value() == "catch*",
-                    "catch block must begin with catch*");
+                case SpecialIf: {
+                    checkArgsBetween("if", 2, 3, argCount);
 
-                // We don't need excSym at this scope, but we want to check
-                // that the catch block is valid always, not just in case of
-                // an exception.
-                const malSymbol* excSym =
-                    VALUE_CAST(malSymbol, catchBlock->item(1));
+                    bool isTrue = interpret(list->item(1), env)->isTrue();
+                    if (!isTrue && (argCount == 2)) {
+                        return mal::nilValue();
+                    }
+                    ast = list->item(isTrue ? 2 : 3);
+                    continue; // TCO
+                }
 
-                malValuePtr excVal;
+                case SpecialLet: {
+                    checkArgsIs("let*", 2, argCount);
+                    const malSequence* bindings =
+                        VALUE_CAST(malSequence, list->item(1));
+                    int count = checkArgsEven("let*", bindings->count());
+                    malEnvPtr inner(new malEnv(env));
+                    for (int i = 0; i < count; i += 2) {
+                        const malSymbol* var =
+                            VALUE_CAST(malSymbol, bindings->item(i));
+                        inner->bind(var, interpret(bindings->item(i+1), inner));
+                    }
+                    ast = list->item(2);
+                    env = std::move(inner);
+                    continue; // TCO
+                }
 
-                try {
-                    ast = EVAL(tryBody, env);
+                case SpecialMacroExpand: {
+                    checkArgsIs("macroexpand", 1, argCount);
+                    return macroExpand(list->item(1), env);
                 }
-                catch(String& s) {
-                    excVal = mal::string(s);
+
+                case SpecialQuasiQuote: {
+                    checkArgsIs("quasiquote", 1, argCount);
+                    // The rewrite only depends on the form, so it's done
+                    // once and kept.
+                    malCallSite& site = list->callSite();
+                    if (!site.quasiquoted) {
+                        site.quasiquoted = quasiquote(list->item(1));
+                    }
+                    ast = site.quasiquoted;
+                    continue; // TCO
                 }
-                catch (malEmptyInputException&) {
-                    // Not an error, continue as if we got nil
-                    ast = mal::nilValue();
+
+                case SpecialQuote: {
+                    checkArgsIs("quote", 1, argCount);
+                    return list->item(1);
                 }
-                catch(malValuePtr& o) {
-                    excVal = o;
-                };
-
-                if (excVal) {
-                    // we got some exception
-                    env = malEnvPtr(new malEnv(env));
-                    env->set(excSym->value(), excVal);
-                    ast = catchBlock->item(2);
+
+                case SpecialTry: {
+                    checkArgsIs("try*", 2, argCount);
+                    malValuePtr tryBody = list->item(1);
+                    const malList* catchBlock =
+                        VALUE_CAST(malList, list->item(2));
+
+                    checkArgsIs("catch*", 2, catchBlock->count() - 1);
+                    MAL_CHECK(VALUE_CAST(malSymbol,
+                        catchBlock->item(0))->value() == "catch*",
+                        "catch block must begin with catch*");
+
+                    // We don't need excSym at this scope, but we want to check
+                    // that the catch block is valid always, not just in case of
+                    // an exception.
+                    const malSymbol* excSym =
+                        VALUE_CAST(malSymbol, catchBlock->item(1));
+
+                    malValuePtr excVal;
+
+                    try {
+                        ast = interpret(tryBody, env);
+                    }
+                    catch(String& s) {
+                        excVal = mal::string(s);
+                    }
+                    catch (malEmptyInputException&) {
+                        // Not an error, continue as if we got nil
+                        ast = mal::nilValue();
+                    }
+                    catch(malValuePtr& o) {
+                        excVal = o;
+                    };
+
+                    if (excVal) {
+                        // we got some exception
+                        env = malEnvPtr(new malEnv(env));
+                        env->bind(excSym, excVal);
+                        ast = catchBlock->item(2);
+                    }
+                    continue; // TCO
                 }
-                continue; // TCO
+                default:
+                    break;
             }
         }
 
         // Now we're left with the case of a regular list to be evaluated.
-        std::unique_ptr<malValueVec> items(list->evalItems(env));
-        malValuePtr op = items->at(0);
+        int count = list->count();
+        ArgStack::Frame items;
+        items.push(op ? op : evalOp(list, env));
+        for (int i = 1; i < count; i++) {
+            items.push(interpret(list->item(i), env));
+        }
+        op = items[0];
         if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
             ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin()+1, items->end());
+            env = lambda->makeEnv(items.begin()+1, items.end());
             continue; // TCO
         }
         else {
-            return APPLY(op, items->begin()+1, items->end());
+            return APPLY(op, items.begin()+1, items.end());
         }
     }
 }
@@ -242,7 +332,7 @@ String PRINT(malValuePtr ast)
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op, malValueIter argsBegin, malValueIter argsEnd)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
@@ -251,19 +341,19 @@ malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
     return handler->apply(argsBegin, argsEnd);
 }
 
-static bool isSymbol(malValuePtr obj, const String& text)
+static bool isSymbol(const malValuePtr& obj, const String& text)
 {
     const malSymbol* sym = DYNAMIC_CAST(malSymbol, obj);
     return sym && (sym->value() == text);
 }
 
-static const malSequence* isPair(malValuePtr obj)
+static const malSequence* isPair(const malValuePtr& obj)
 {
     const malSequence* list = DYNAMIC_CAST(malSequence, obj);
     return list && !list->isEmpty() ? list : NULL;
 }
 
-static malValuePtr quasiquote(malValuePtr obj)
+malValuePtr quasiquote(malValuePtr obj)
 {
     const malSequence* seq = isPair(obj);
     if (!seq) {
@@ -297,30 +387,105 @@ static malValuePtr quasiquote(malValuePtr obj)
     }
 }
 
-static const malLambda* isMacroApplication(malValuePtr obj, malEnvPtr env)
+// A call's head is usually a global function, so the list remembers what it
+// resolved to until the global environment changes. A symbol which has been
+// bound locally anywhere could be shadowed, so it is always looked up.
+static malValuePtr cachedOp(const malList* list)
 {
-    if (const malSequence* seq = isPair(obj)) {
-        if (malSymbol* sym = DYNAMIC_CAST(malSymbol, seq->first())) {
-            if (malEnvPtr symEnv = env->find(sym->value())) {
-                malValuePtr value = sym->eval(symEnv);
-                if (malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
-                    return lambda->isMacro() ? lambda : NULL;
-                }
-            }
-        }
+    const malCallSite& site = list->callSite();
+    if (site.op && (site.opVersion == malEnv::version()) &&
+            !STATIC_CAST(malSymbol, list->item(0))->isLocal()) {
+        return site.op;
     }
     return NULL;
 }
 
-static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
+static malValuePtr evalOp(const malList* list, const malEnvPtr& env)
+{
+    const malValuePtr& head = list->item(0);
+    malValuePtr op = interpret(head, env);
+    const malSymbol* symbol = DYNAMIC_CAST(malSymbol, head);
+    malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
+    if (symbol && !symbol->isLocal() && handler) {
+        malCallSite& site = list->callSite();
+        site.op = handler;
+        site.opVersion = malEnv::version();
+    }
+    return op;
+}
+
+static malValuePtr isMacroApplication(const malValuePtr& obj,
+                                      const malEnvPtr& env)
 {
-    while (const malLambda* macro = isMacroApplication(obj, env)) {
-        const malSequence* seq = STATIC_CAST(malSequence, obj);
-        obj = macro->apply(seq->begin() + 1, seq->end());
+    const malList* seq = DYNAMIC_CAST(malList, obj);
+    if (!seq || seq->isEmpty()) {
+        return malValuePtr();
+    }
+    malSymbol* sym = DYNAMIC_CAST(malSymbol, seq->item(0));
+    if (!sym) {
+        return malValuePtr();
+    }
+
+    malValuePtr value;
+    if (!sym->isLocal()) {
+        // The head's global binding is remembered, so checking it again is
+        // just a pointer dereference.
+        malCallSite& site = seq->callSite();
+        if (!site.headCell) {
+            site.headCell = env->globalCell(sym);
+        }
+        if (site.headCell) {
+            value = *site.headCell;
+        }
+    }
+    else if (malEnvPtr symEnv = env->find(sym)) {
+        value = sym->eval(symEnv);
+    }
+
+    malLambda* lambda = DYNAMIC_CAST(malLambda, value);
+    return lambda && lambda->isMacro() ? value : malValuePtr();
+}
+
+static malValuePtr macroExpand(malValuePtr obj, const malEnvPtr& env)
+{
+    while (malValuePtr macro = isMacroApplication(obj, env)) {
+        // Each form is expanded once, and again only if the macro it used
+        // has been redefined since. The macro is held while it runs, as it
+        // may redefine itself.
+        const malList* seq = STATIC_CAST(malList, obj);
+        malCallSite& site = seq->callSite();
+        if (site.expandedBy != macro) {
+            site.expansion = seq->applyArgs(STATIC_CAST(malLambda, macro));
+            site.expandedBy = macro;
+        }
+        obj = site.expansion;
     }
     return obj;
 }
 
+static void installSpecialForms()
+{
+    static const struct {
+        const char* name;
+        SpecialForm id;
+    } specialForms[] = {
+        { "def!",        SpecialDef },
+        { "defmacro!",   SpecialDefMacro },
+        { "do",          SpecialDo },
+        { "fn*",         SpecialFn },
+        { "if",          SpecialIf },
+        { "let*",        SpecialLet },
+        { "macroexpand", SpecialMacroExpand },
+        { "quasiquote",  SpecialQuasiQuote },
+        { "quote",       SpecialQuote },
+        { "try*",        SpecialTry },
+    };
+    for (auto& form : specialForms) {
+        STATIC_CAST(malSymbol, mal::symbol(form.name))
+            ->setSpecialForm(form.id);
+    }
+}
+
 static const char* macroTable[] = {
     "(defmacro! cond (fn* (& xs) (if (> (count xs) 0) (list 'if (first xs) (if (> (count xs) 1) (nth xs 1) (throw \"odd number of forms to cond\")) (cons 'cond (rest (rest xs)))))))",
     "(defmacro! or (fn* (& xs) (if (empty? xs) nil (if (= 1 (count xs)) (first xs) (let* (condvar (gensym)) `(let* (~condvar ~(first xs)) (if ~condvar ~condvar (or ~@(rest xs)))))))))",
@@ -348,8 +513,6 @@ static const char* malFunctionTable[] = {
     "(def! >= (fn* (a b) (<= b a)))",
     "(def! < (fn* (a b) (not (<= b a))))",
     "(def! > (fn* (a b) (not (<= a b))))",
-    "(def! load-file (fn* (filename) \
-        (eval (read-string (str \"(do \" (slurp filename) \")\")))))",
     "(def! map (fn* (f xs) (if (empty? xs) xs \
         (cons (f (first xs)) (map f (rest xs))))))",
     "(def! *gensym-counter* (atom 0))",